@@ -0,0 +1,38 @@
+/* addr_pool.h */
+#ifndef _ADDR_POOL_H
+#define _ADDR_POOL_H
+
+#include <stdint.h>
+
+enum {
+	ADDR_USED,		/* some lease in the table has it */
+	ADDR_RESERVED,		/* static lease, network or broadcast address */
+	ADDR_CONFLICT,		/* answered an ARP probe */
+	ADDR_PROBED,		/* held by the pre-prober */
+	ADDR_MAPS
+};
+
+/* one bit per address from start to end in every map */
+struct addr_pool {
+	uint32_t start, end;	/* host order */
+	uint32_t cursor;	/* offset the next free search starts at */
+	unsigned long *map[ADDR_MAPS];
+};
+
+extern struct addr_pool addr_pool;
+
+/* start and end in network order */
+void addr_pool_init(struct addr_pool *pool, uint32_t start, uint32_t end);
+
+/* set or clear ip's (network order) bit in map, ignored outside the pool */
+void addr_pool_mark(struct addr_pool *pool, int map, uint32_t ip, int set);
+
+/* next address without any bit set, searching round robin from the
+ * cursor. Network order, 0 if the pool is exhausted */
+uint32_t addr_pool_next_free(struct addr_pool *pool);
+
+/* next address after ip (0 to start at the beginning) that is used or
+ * conflicting but not reserved, 0 when there are no more */
+uint32_t addr_pool_next_taken(struct addr_pool *pool, uint32_t ip);
+
+#endif
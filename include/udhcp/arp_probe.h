@@ -0,0 +1,45 @@
+/* arp_probe.h */
+#ifndef _ARP_PROBE_H
+#define _ARP_PROBE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "udhcp/request.h"
+
+#define ARP_PROBE_MAX		64	/* OFFERs that can wait on a probe */
+#define ARP_PROBE_TIMEOUT	2	/* seconds, as arpping() */
+
+/* open the probe socket, -1 leaves everything to the blocking arpping() */
+int arp_probe_init(uint32_t ip, uint8_t *mac, char *interface);
+
+/* the socket to select on, -1 if there is none */
+int arp_probe_fd(void);
+
+/* 1 if another probe can be started */
+int arp_probe_room(void);
+
+/* 1 if the client's previous DISCOVER is still being probed for */
+int arp_probe_pending(uint8_t *chaddr);
+
+/* probe yiaddr and send the OFFER for request once it is known to be
+ * free, 0 if the probe was started */
+int arp_probe_start(struct dhcp_request *request, uint32_t yiaddr);
+
+/* send a single ARP request for yiaddr, <0 on errors */
+int arp_probe_send(uint32_t yiaddr);
+
+/* yiaddr answered a probe, keep it away from clients for conflict_time */
+void arp_probe_conflict(uint32_t yiaddr);
+
+/* handle the replies waiting on the socket. Both are called with
+ * server_lock held, and drop it to replay the OFFERs once the probe
+ * table has been walked */
+void arp_probe_read(void);
+
+/* finish the probes nobody answered */
+void arp_probe_expire(void);
+
+/* when the next probe times out, 0 if none is pending */
+time_t arp_probe_deadline(void);
+
+#endif
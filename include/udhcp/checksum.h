@@ -0,0 +1,24 @@
+/* checksum.h */
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <stdint.h>
+
+/* the internet checksum of count bytes at addr, with the fastest
+ * implementation this CPU has (also declared in packet.h) */
+uint16_t checksum(void *addr, int count);
+
+/* the implementations checksum() picks from, for the tests and the
+ * benchmark. Each returns the same as checksum() */
+uint16_t checksum_scalar(void *addr, int count);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86
+uint16_t checksum_sse2(void *addr, int count);
+uint16_t checksum_avx2(void *addr, int count);
+
+/* 1 if the CPU runs checksum_sse2()/checksum_avx2() */
+int checksum_have_sse2(void);
+int checksum_have_avx2(void);
+#endif
+
+#endif
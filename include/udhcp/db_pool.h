@@ -0,0 +1,41 @@
+/* db_pool.h */
+#ifndef _DB_POOL_H
+#define _DB_POOL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <mysql.h>
+
+#define DB_STMT_MAX	16
+
+struct db_conn {
+	MYSQL *mysql;		/* NULL until the slot is connected */
+	MYSQL_STMT *stmt[DB_STMT_MAX]; /* prepared on first use, see db_query.c */
+	time_t last_used;
+	int busy;
+};
+
+struct db_pool_t {
+	uint32_t size;		/* connections kept open to the server */
+	uint32_t ping_interval;	/* ping a connection idle this long before use */
+	uint32_t connect_timeout;
+	struct db_conn *conns;
+};
+
+extern struct db_pool_t db_pool;
+
+/* Allocate the pool and open the first connection, returns -1 if the
+ * database can't be reached (the server keeps running and retries) */
+int db_pool_init(void);
+
+/* Hand out a live connection, reconnecting a dead one if needed.
+ * Returns NULL if no connection could be made */
+struct db_conn *db_conn_get(void);
+
+/* Give a connection back, if failed is set the connection is dropped
+ * and will be reopened by the next db_conn_get() */
+void db_conn_put(struct db_conn *conn, int failed);
+
+void db_pool_close(void);
+
+#endif
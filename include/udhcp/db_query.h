@@ -0,0 +1,50 @@
+/* db_query.h */
+#ifndef _DB_QUERY_H
+#define _DB_QUERY_H
+
+#include <stdint.h>
+
+/* Prepared statements, one set per pooled connection */
+enum {
+	DB_IP_BY_MAC,
+	DB_IP_RESERVED,
+	DB_ADD_STATIC,
+	DB_OPTIONS_BY_CLASS,
+	DB_STATIC_FINGERPRINT,
+	DB_ALL_STATIC,
+	DB_OPTIONS_FINGERPRINT,
+	DB_ALL_OPTIONS,
+	DB_STMT_COUNT
+};
+
+/* 1 if mac has a static lease (ip in network order, class or -1 if the
+ * lease has none), 0 if it doesn't, -1 on database errors */
+int db_ip_by_mac(uint8_t *mac, uint32_t *ip, int32_t *class);
+
+/* 1 if ip (network order) is handed out as a static lease, 0 if not,
+ * -1 on database errors */
+int db_ip_reserved(uint32_t ip);
+
+/* store a static lease, returns 1 on success */
+int db_add_static_lease(uint8_t *mac, uint32_t ip);
+
+/* append the options of class (-1 for none) plus the class 0 defaults
+ * to optionptr, returns the number of options added or -1 on errors */
+int db_add_class_options(uint8_t *optionptr, int32_t class);
+
+/* row count and a checksum over the static lease table, cheap enough
+ * to poll so an unchanged table doesn't have to be read again */
+int db_static_fingerprint(uint32_t *rows, uint32_t *sum);
+
+/* call fn for every static lease (ip network order, class -1 if none),
+ * returns the number of rows or -1 on errors */
+int db_foreach_static_lease(void (*fn)(uint8_t *mac, uint32_t ip, int32_t class, void *arg), void *arg);
+
+/* the same for the options table */
+int db_options_fingerprint(uint32_t *rows, uint32_t *sum);
+
+/* call fn for every option row ordered by code, data is the text as
+ * stored, returns the number of rows or -1 on errors */
+int db_foreach_option(void (*fn)(int32_t class, uint8_t code, char *data, void *arg), void *arg);
+
+#endif
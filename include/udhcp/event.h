@@ -0,0 +1,50 @@
+/* event.h */
+#ifndef _EVENT_H
+#define _EVENT_H
+
+#include <time.h>
+#include <sys/epoll.h>
+
+#define EVENT_BATCH	32	/* events taken per epoll_wait() */
+
+typedef void (*event_handler)(int fd, void *arg);
+
+struct event_source {
+	event_handler handler;	/* NULL if the fd is not watched */
+	void *arg;
+	int timer;		/* a timerfd, read before the handler runs */
+};
+
+/* An epoll set and what to call for each of its fds, indexed by fd.
+ * Timers are timerfds in the same set, so everything the daemon waits
+ * on (sockets, signal pipe, deadlines) wakes up the one epoll_wait(). */
+struct event_loop {
+	int epfd;
+	int wake;		/* eventfd, written by event_loop_stop() */
+	int running;
+	int size;		/* entries in sources */
+	struct event_source *sources;
+};
+
+/* <0 if epoll is not available */
+int event_loop_init(struct event_loop *loop);
+void event_loop_close(struct event_loop *loop);
+
+/* call handler whenever fd is readable, <0 on errors */
+int event_add(struct event_loop *loop, int fd, event_handler handler, void *arg);
+
+/* stop watching fd, call before closing it */
+void event_del(struct event_loop *loop, int fd);
+
+/* a timer calling handler, disarmed until event_timer_set(), returns its fd */
+int event_timer_new(struct event_loop *loop, event_handler handler, void *arg);
+
+/* fire at wall clock time when (0 disarms), then every interval seconds
+ * if interval is not 0 */
+void event_timer_set(int fd, time_t when, unsigned long interval);
+
+/* dispatch events until event_loop_stop(), which any thread may call */
+void event_loop_run(struct event_loop *loop);
+void event_loop_stop(struct event_loop *loop);
+
+#endif
@@ -0,0 +1,63 @@
+/* journal.h */
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdint.h>
+#include "udhcp/leases.h"
+
+#define JOURNAL_LEASE	1	/* chaddr holds yiaddr until expires */
+#define JOURNAL_RESERVE	2	/* nobody gets yiaddr until expires */
+
+/* one change to the lease table, as appended to the journal. The
+ * times are absolute and everything is in network order */
+struct journal_record {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t check;		/* internet checksum over the record */
+	uint32_t yiaddr;
+	uint32_t expires;
+	uint8_t chaddr[16];
+};
+
+struct journal_t {
+	char enabled;		/* "journal" in udhcpd.conf */
+	uint32_t max_size;	/* "journal_size", bytes before it is folded into the lease file */
+};
+
+extern struct journal_t journal;
+
+/* start appending to the lease file's journal, after read_leases()
+ * replayed it. <0 if it can't be opened, the server runs without */
+int journal_open(void);
+void journal_close(void);
+
+/* readable when the journal outgrew journal_size, -1 without a journal */
+int journal_wake_fd(void);
+
+/* record a change, with server_lock held. Nothing is written before
+ * journal_commit() */
+void journal_lease(struct dhcpOfferedAddr *lease);
+void journal_reserve(uint32_t yiaddr, uint32_t expires);
+
+/* write and fsync what was recorded so far, one caller syncs for all
+ * that are waiting. Call before the replies it covers are sent */
+void journal_commit(void);
+
+/* apply the journal, an old one first, to the lease table, with
+ * lease_shards_lock() held. Returns the records applied */
+int journal_replay(void);
+
+/* the lease file about to be written holds everything recorded so far,
+ * with lease_shards_lock() held. Records from now on go to a new
+ * journal, the old one is kept until the file is on disk. If an old
+ * one is still kept from a failed write, the journal is left alone */
+void journal_rotate(void);
+
+/* the lease file written after journal_rotate() is on disk */
+void journal_snapshot_done(void);
+
+/* fsync the directory file is in, so a rename or a file created in it
+ * survives a crash */
+int sync_dir(const char *file);
+
+#endif
@@ -0,0 +1,54 @@
+/* lease_db.h */
+#ifndef _LEASE_DB_H
+#define _LEASE_DB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "udhcp/leases.h"
+
+#define LEASE_DB_MAGIC		"udhcpLDB"
+#define LEASE_DB_VERSION	1
+
+#define LEASE_DB_REMAINING	1	/* expires are seconds left, "remaining yes" */
+
+#define LEASE_DB_EMPTY		0xffffffff	/* free index slot */
+
+/* The lease file: this header, count records of struct dhcpOfferedAddr
+ * as the old file had them, then index_slots record numbers hashed by
+ * chaddr (linear probing, reservations with a blank chaddr left out).
+ * Everything is in network order and 4 byte aligned, so the file is
+ * used straight from a read only mapping. */
+struct lease_db_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t record_size;
+	uint32_t count;
+	uint32_t index_slots;	/* a power of two */
+	uint32_t written;	/* when, seconds since the epoch */
+};
+
+struct lease_db {
+	uint8_t *map;
+	size_t size;
+	struct lease_db_header *header;
+	struct dhcpOfferedAddr *records;
+	uint32_t count;
+	uint32_t flags;
+	uint32_t *index;
+	uint32_t slots;
+};
+
+/* map a lease file, -1 if it can't be read, -2 if it isn't one of this
+ * version (an old raw file of records maybe) */
+int lease_db_open(struct lease_db *db, const char *file);
+void lease_db_close(struct lease_db *db);
+
+/* the record of chaddr, NULL if it has none */
+struct dhcpOfferedAddr *lease_db_find(struct lease_db *db, uint8_t *chaddr);
+
+/* write count records, already in file order, and their index to fp */
+int lease_db_write(FILE *fp, struct dhcpOfferedAddr *records, uint32_t count, uint32_t flags);
+
+#endif
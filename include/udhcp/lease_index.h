@@ -0,0 +1,41 @@
+/* lease_index.h */
+#ifndef _LEASE_INDEX_H
+#define _LEASE_INDEX_H
+
+#include <stdint.h>
+#include "udhcp/leases.h"
+
+/* Open addressing hashes over a lease array, by chaddr and by yiaddr,
+ * and a min-heap of all leases by expires. Blank chaddrs and zero
+ * yiaddrs are not hashed, the callers scan for those. A lease must be
+ * removed before its keys change and put back afterwards; expires is
+ * only changed through lease_index_set_expires(). */
+struct lease_index {
+	struct dhcpOfferedAddr *leases;
+	uint32_t count;		/* leases in the array */
+	uint32_t mask;		/* hash slots - 1 */
+	int32_t *by_chaddr;	/* lease number, -1 if the slot is empty */
+	int32_t *by_yiaddr;
+	int32_t *heap;		/* lease numbers, soonest expiry first */
+	int32_t *heap_pos;	/* where each lease sits in heap */
+};
+
+void lease_index_init(struct lease_index *idx, struct dhcpOfferedAddr *leases, uint32_t count);
+void lease_index_insert(struct lease_index *idx, struct dhcpOfferedAddr *lease);
+void lease_index_remove(struct lease_index *idx, struct dhcpOfferedAddr *lease);
+struct dhcpOfferedAddr *lease_index_chaddr(struct lease_index *idx, uint8_t *chaddr);
+struct dhcpOfferedAddr *lease_index_yiaddr(struct lease_index *idx, uint32_t yiaddr);
+
+/* the lease that expires first, whether or not it has expired yet */
+struct dhcpOfferedAddr *lease_index_oldest(struct lease_index *idx);
+
+/* set a lease's expiry time and move it in the heap */
+void lease_index_set_expires(struct lease_index *idx, struct dhcpOfferedAddr *lease, uint32_t expires);
+
+/* forget who holds a lease, keeping the address taken */
+void lease_index_clear_chaddr(struct lease_index *idx, struct dhcpOfferedAddr *lease);
+
+/* the hash by_chaddr is keyed on, for other tables of chaddrs */
+uint32_t lease_index_hash_chaddr(uint8_t *chaddr);
+
+#endif
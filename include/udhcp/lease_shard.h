@@ -0,0 +1,70 @@
+/* lease_shard.h */
+#ifndef _LEASE_SHARD_H
+#define _LEASE_SHARD_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "udhcp/leases.h"
+#include "udhcp/lease_index.h"
+
+/* A slice of the lease array with its own indexes and lock. A client's
+ * lease always lives in the shard its chaddr hashes to. */
+struct lease_shard {
+	pthread_mutex_t lock;
+	struct lease_index index;	/* over leases[first .. first + index.count) */
+	uint32_t first;
+};
+
+/* who holds each address of the pool, under server_lock */
+struct lease_owner {
+	int32_t lease;		/* lease number, -1 for none */
+	uint32_t expires;	/* of a conflict or DECLINE reservation (lease is -1) */
+};
+
+struct lease_shards_t {
+	uint32_t count;		/* "lease_shards" in udhcpd.conf, 0 means one per worker */
+	struct lease_shard *s;
+	uint32_t total;		/* leases in the array */
+	uint32_t start, size;	/* pool, host order */
+	struct lease_owner *owner;
+};
+
+extern struct lease_shards_t lease_shards;
+
+/* split count leases into the shards and set up the owner table */
+void lease_shards_init(struct dhcpOfferedAddr *leases, uint32_t count);
+
+/* the shard chaddr hashes to, the same split the workers use */
+struct lease_shard *lease_shard(uint8_t *chaddr);
+
+/* the shard a lease lives in, NULL if it isn't in the array */
+struct lease_shard *lease_shard_of(struct dhcpOfferedAddr *lease);
+
+/* every shard in order, then server_lock */
+void lease_shards_lock(void);
+void lease_shards_unlock(void);
+
+/* owner table entry for yiaddr, NULL outside the pool */
+struct lease_owner *lease_owner(uint32_t yiaddr);
+
+/* 1 unless another lease or a reservation has taken its address since */
+int lease_current(struct dhcpOfferedAddr *lease);
+
+/* next reserved address after ip (0 to start at the beginning), 0 when
+ * there are no more */
+uint32_t lease_reserved_next(uint32_t ip, uint32_t *expires);
+
+/* in leases.c, with server_lock held. A lease of another shard may
+ * only be looked at, its own shard's lock is needed to change it */
+int lease_taken(uint32_t yiaddr);
+void lease_reserve(uint32_t yiaddr, unsigned long seconds);
+void lease_forget(struct dhcpOfferedAddr *lease);
+void lease_decline(struct dhcpOfferedAddr *lease, unsigned long seconds);
+void lease_set_expires(struct dhcpOfferedAddr *lease, uint32_t expires);
+
+/* load the lease file's records into the empty table, with
+ * lease_shards_lock() held. remaining if their times are. Returns the
+ * records loaded, *full is set to those that found no room */
+uint32_t lease_load(struct dhcpOfferedAddr *records, uint32_t count, int remaining, uint32_t *full);
+
+#endif
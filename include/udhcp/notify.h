@@ -0,0 +1,33 @@
+/* notify.h */
+#ifndef _NOTIFY_H
+#define _NOTIFY_H
+
+#include <stdint.h>
+#include "udhcp/leases.h"
+#include "udhcp/event.h"
+
+struct notify_t {
+	char *socket;		/* "notify_socket", a unix socket someone reads lease events from */
+	uint32_t queue;		/* "notify_queue", events kept while the reader is slow or away */
+};
+
+extern struct notify_t notify;
+
+/* start sending lease events and running notify_file from loop, after
+ * background(). <0 if it can't, the server runs without */
+int notify_open(struct event_loop *loop);
+
+/* run notify_file for a lease file written just before, once a run
+ * still going has exited but without waiting for it, and stop sending */
+void notify_close(void);
+
+/* a lease file was written, from any thread. notify_file runs from the
+ * event loop, or once it is up */
+void notify_snapshot(void);
+
+/* queue a change for the reader, with server_lock held. Never blocks,
+ * when the queue is full the event is dropped and counted */
+void notify_lease(struct dhcpOfferedAddr *lease);
+void notify_reserve(uint32_t yiaddr, uint32_t expires);
+
+#endif
@@ -0,0 +1,32 @@
+/* option_builder.h */
+#ifndef _OPTION_BUILDER_H
+#define _OPTION_BUILDER_H
+
+#include <stdint.h>
+
+/* Appends options to a packet's options field. It remembers where the
+ * DHCP_END option is, instead of add_option_string() finding it again
+ * for every option. */
+struct option_builder {
+	uint8_t *options;	/* the field, always ends with DHCP_END */
+	int end;		/* where DHCP_END is */
+	int size;		/* bytes in the field */
+};
+
+/* start appending to an options field that already ends with DHCP_END */
+void option_builder_init(struct option_builder *b, uint8_t *options);
+
+/* find DHCP_END again after the field was written without b */
+void option_builder_sync(struct option_builder *b);
+
+/* add an option string (code, length, data), the bytes added or 0 if
+ * it didn't fit */
+int option_builder_add(struct option_builder *b, uint8_t *string);
+
+/* add len bytes of whole options at once, 0 if they don't all fit */
+int option_builder_append(struct option_builder *b, uint8_t *data, int len);
+
+/* add a one to four byte option of a type dhcp_options[] knows */
+int option_builder_simple(struct option_builder *b, uint8_t code, uint32_t data);
+
+#endif
@@ -0,0 +1,28 @@
+/* option_cache.h */
+#ifndef _OPTION_CACHE_H
+#define _OPTION_CACHE_H
+
+#include <stdint.h>
+#include "udhcp/packet.h"
+#include "udhcp/option_builder.h"
+
+struct option_cache_t {
+	uint32_t refresh;	/* seconds between refreshes, 0 to only refresh on SIGUSR2 */
+	int loaded;		/* the table was compiled at least once */
+	uint32_t rows;		/* fingerprint of the table we compiled */
+	uint32_t sum;
+};
+
+extern struct option_cache_t option_cache;
+
+/* Recompile the per class option blobs from the options table. Unless
+ * force is set, an unchanged table (same fingerprint) is not read again */
+int option_cache_refresh(int force);
+
+/* start a reply from the template of class (-1 for none), opts appends
+ * after its options. Returns the number of options the class has, 0
+ * without copying anything if it has none, or -1 if the cache isn't
+ * loaded yet and the caller should ask the database */
+int option_cache_reply(struct dhcpMessage *packet, struct option_builder *opts, int32_t class);
+
+#endif
@@ -0,0 +1,25 @@
+/* option_index.h */
+#ifndef _OPTION_INDEX_H
+#define _OPTION_INDEX_H
+
+#include <stdint.h>
+#include "udhcp/packet.h"
+
+/* Where each option of a received packet is, found in one pass over
+ * the options field and the file/sname fields it overloads. Offsets
+ * count from the start of the packet so a copy of the packet can use
+ * the same index. The first of repeated options wins, as it did with
+ * get_option(). */
+struct option_index {
+	uint16_t off[256];	/* of the option data, 0 if the option is absent */
+	uint8_t len[256];
+};
+
+/* index packet's options, <0 if they run past their field. Options
+ * before the damage are still indexed */
+int option_index_build(struct option_index *idx, struct dhcpMessage *packet);
+
+/* the data of option code in packet, NULL if it has none */
+uint8_t *option_index_get(struct option_index *idx, struct dhcpMessage *packet, int code);
+
+#endif
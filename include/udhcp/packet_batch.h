@@ -0,0 +1,71 @@
+/* packet_batch.h */
+#ifndef _PACKET_BATCH_H
+#define _PACKET_BATCH_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <asm/types.h>
+#include <linux/if_packet.h>
+#include "udhcp/packet.h"
+#include "udhcp/packet_ring.h"
+#include "udhcp/option_index.h"
+
+#define RX_BATCH	32	/* datagrams taken per recvmmsg() */
+
+/* preallocated buffers for get_packets(), set up by rx_ring_init() */
+struct rx_ring {
+	struct dhcpMessage packets[RX_BATCH];
+	int bytes[RX_BATCH];	/* as get_packet() returns for each */
+	struct option_index index[RX_BATCH];
+	struct mmsghdr msgs[RX_BATCH];
+	struct iovec iov[RX_BATCH];
+};
+
+void rx_ring_init(struct rx_ring *ring);
+int get_packets(struct rx_ring *ring, int fd);
+
+#define TX_BATCH	32	/* replies sent per sendmmsg() */
+
+/* One raw and one UDP socket kept open for replies, instead of a new
+ * socket per raw_packet()/kernel_packet(). Queued replies go out on
+ * tx_queue_flush() or when the queue fills up. */
+struct tx_queue {
+	int raw_fd;		/* -1 falls back to raw_packet() */
+	int udp_fd;		/* -1 falls back to kernel_packet() */
+	uint32_t source_ip;
+	int source_port;
+	int ifindex;
+	int raw_count, udp_count;
+	struct udp_dhcp_packet raw[TX_BATCH];
+	struct sockaddr_ll raw_dest[TX_BATCH];
+	struct mmsghdr raw_msgs[TX_BATCH];
+	struct iovec raw_iov[TX_BATCH];
+	struct dhcpMessage udp[TX_BATCH];
+	struct sockaddr_in udp_dest[TX_BATCH];
+	struct mmsghdr udp_msgs[TX_BATCH];
+	struct iovec udp_iov[TX_BATCH];
+	int ring_fd;		/* raw replies go through ring when it is mapped */
+	struct packet_ring ring;
+	uint8_t mac[6];
+	void (*before_send)(void);	/* called before any reply leaves, NULL for none */
+};
+
+/* where this thread queues the server's replies, in dhcpd.c */
+extern __thread struct tx_queue *tx_queue;
+
+/* <0 if a socket could not be opened, its replies are then sent unbatched.
+ * reuseport when other queues bind the same source */
+int tx_queue_init(struct tx_queue *q, uint32_t source_ip, int source_port, int ifindex,
+		  int reuseport);
+
+/* send raw replies from mac through a PACKET_TX_RING, <0 leaves them on sendmmsg() */
+int tx_queue_mmap(struct tx_queue *q, uint8_t *mac);
+int queue_raw_packet(struct tx_queue *q, struct dhcpMessage *payload,
+		     uint32_t dest_ip, int dest_port, uint8_t *dest_arp);
+int queue_kernel_packet(struct tx_queue *q, struct dhcpMessage *payload,
+			uint32_t dest_ip, int dest_port);
+int tx_queue_flush(struct tx_queue *q);
+
+#endif
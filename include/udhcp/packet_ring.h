@@ -0,0 +1,60 @@
+/* packet_ring.h */
+#ifndef _PACKET_RING_H
+#define _PACKET_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/if_packet.h>
+
+#define RING_FRAME_SIZE	2048	/* holds a whole udp_dhcp_packet and headers */
+#define RING_TX_FRAMES	64
+#define RING_RX_BLOCKS	4
+#define RING_RX_BLOCK_SIZE (1 << 16)
+#define RING_RX_TIMEOUT	10	/* ms before a partly filled block is handed over */
+
+/* A TPACKET_V3 ring mapped over a packet socket. Either direction,
+ * set up by packet_ring_rx() or packet_ring_tx(); map is NULL when
+ * the ring is not in use and the socket is read/written as usual. */
+struct packet_ring {
+	int fd;
+	uint8_t *map;
+	size_t size;
+	uint32_t block_size, block_nr;
+	uint32_t frame_nr;
+	uint32_t current;		/* rx block or tx frame we are at */
+	uint32_t left;			/* rx packets left in the current block */
+	struct tpacket3_hdr *next;	/* next rx packet */
+	uint32_t status;		/* tp_status of the last rx packet */
+	uint32_t queued;		/* tx frames waiting for packet_ring_send() */
+};
+
+/* "packet_mmap" in udhcpd.conf, -m for udhcpc */
+extern char packet_mmap;
+
+/* the client's raw socket ring, in clientsocket.c */
+extern struct packet_ring raw_ring;
+
+/* map a ring on fd, <0 if the kernel can't (the socket is left usable) */
+int packet_ring_rx(struct packet_ring *ring, int fd);
+int packet_ring_tx(struct packet_ring *ring, int fd);
+void packet_ring_close(struct packet_ring *ring);
+
+/* the next received frame from the network header on, NULL if none */
+uint8_t *packet_ring_recv(struct packet_ring *ring, int *len);
+
+/* 1 if the udp checksum of the last received frame needs no checking:
+ * the kernel or the NIC checked it, or the frame is a local one whose
+ * checksum isn't filled in yet */
+int packet_ring_csum_ok(struct packet_ring *ring);
+
+/* a tx frame to build an ethernet frame in, placed so the ip header
+ * after the link header is aligned. NULL if the ring is full */
+uint8_t *packet_ring_frame(struct packet_ring *ring);
+
+/* queue the frame packet_ring_frame() returned, len bytes long */
+void packet_ring_commit(struct packet_ring *ring, int len);
+
+/* have the kernel send the queued frames */
+int packet_ring_send(struct packet_ring *ring);
+
+#endif
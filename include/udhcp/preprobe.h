@@ -0,0 +1,32 @@
+/* preprobe.h */
+#ifndef _PREPROBE_H
+#define _PREPROBE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define PREPROBE_MAX_AGE	60	/* seconds a verified address stays good */
+
+struct preprobe_t {
+	uint32_t count;		/* free addresses to keep verified, 0 to disable */
+	uint32_t rate;		/* probes per second at most */
+};
+
+extern struct preprobe_t preprobe;
+
+/* allocate the tables, needs arp_probe_init() first */
+void preprobe_init(void);
+
+/* an address that answered no ARP probe a moment ago, 0 if none */
+uint32_t preprobe_take(void);
+
+/* yiaddr answered an ARP probe, 1 if it was one of ours */
+int preprobe_reply(uint32_t yiaddr);
+
+/* start probes and collect the unanswered ones */
+void preprobe_run(void);
+
+/* when preprobe_run() has work next, 0 if never */
+time_t preprobe_deadline(void);
+
+#endif
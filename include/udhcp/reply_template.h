@@ -0,0 +1,42 @@
+/* reply_template.h */
+#ifndef _REPLY_TEMPLATE_H
+#define _REPLY_TEMPLATE_H
+
+#include <stdint.h>
+#include "udhcp/packet.h"
+#include "udhcp/option_builder.h"
+
+/* where reply_template_patch() writes, in packet.options */
+#define TEMPLATE_TYPE		2	/* DHCP_MESSAGE_TYPE data */
+#define TEMPLATE_SERVER_ID	5	/* DHCP_SERVER_ID data */
+#define TEMPLATE_LEASE		11	/* DHCP_LEASE_TIME data */
+
+/* An OFFER/ACK with everything that is the same for every client of a
+ * pool or option class already in wire format. A reply starts as a
+ * copy of one and gets its per client fields patched in. */
+struct reply_template {
+	struct dhcpMessage packet;
+	int end;		/* where DHCP_END is in packet.options */
+};
+
+/* made from udhcpd.conf: with its options and the bootp fields, and
+ * bare for the DHCPsql classes the database adds options to */
+extern struct reply_template reply_template, reply_template_bare;
+
+/* the message type, server id and lease time options go first, then
+ * len bytes of whole options with any lease time left out. bootp sets
+ * siaddr, sname and file */
+void reply_template_build(struct reply_template *t, uint8_t *options, int len, int bootp);
+
+/* build reply_template and reply_template_bare, after read_config() */
+void reply_templates_init(void);
+
+/* start a reply to oldpacket from t, opts appends after its options */
+void reply_template_copy(struct dhcpMessage *packet, struct option_builder *opts,
+			 struct reply_template *t);
+void reply_template_patch(struct dhcpMessage *packet, struct dhcpMessage *oldpacket, char type);
+
+/* lease in seconds, host order */
+void reply_template_lease(struct dhcpMessage *packet, uint32_t lease);
+
+#endif
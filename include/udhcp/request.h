@@ -0,0 +1,24 @@
+/* request.h */
+#ifndef _REQUEST_H
+#define _REQUEST_H
+
+#include <stdint.h>
+#include "udhcp/packet.h"
+#include "udhcp/option_index.h"
+
+/* what we learned about the client of the packet being handled, looked
+ * up once and handed to the functions that build the reply */
+struct dhcp_request {
+	struct dhcpMessage *packet;
+	uint32_t static_ip;	/* network order, 0 if the client has no static lease */
+	int32_t class;		/* option class of the static lease, -1 if none */
+	int probed;		/* OFFER replayed after its address passed an ARP probe */
+	struct option_index options;	/* of packet, built when it was read */
+};
+
+void request_init(struct dhcp_request *req, struct dhcpMessage *packet, struct option_index *idx);
+
+/* option code of the request's packet, NULL if it has none */
+uint8_t *request_option(struct dhcp_request *req, int code);
+
+#endif
@@ -0,0 +1,31 @@
+/* static_cache.h */
+#ifndef _STATIC_CACHE_H
+#define _STATIC_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+
+struct static_cache_t {
+	uint32_t refresh;	/* seconds between refreshes, 0 to only refresh on SIGUSR2 */
+	int loaded;		/* the table was read at least once */
+	uint32_t rows;		/* fingerprint of the table we hold */
+	uint32_t sum;
+};
+
+extern struct static_cache_t static_cache;
+
+/* Bring the cache in line with the staticleases table. Unless force is
+ * set, an unchanged table (same fingerprint) is not read again */
+int static_cache_refresh(int force);
+
+/* 1 and ip/class if mac has a static lease, 0 if not, -1 if the cache
+ * was never loaded and the caller should ask the database */
+int static_cache_lookup(uint8_t *mac, uint32_t *ip, int32_t *class);
+
+/* 1 if ip is reserved, 0 if not, -1 if the cache was never loaded */
+int static_cache_reserved(uint32_t ip);
+
+/* keep the cache in step with a lease we just stored */
+void static_cache_add(uint8_t *mac, uint32_t ip, int32_t class);
+
+#endif
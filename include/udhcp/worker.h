@@ -0,0 +1,46 @@
+/* worker.h */
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "udhcp/event.h"
+#include "udhcp/packet_batch.h"
+
+/* A listening socket and what it takes to answer from it. Worker 0
+ * lives in the main thread's event loop, every other one runs its own
+ * loop in a thread of its own. */
+struct worker {
+	int id;
+	pthread_t thread;
+	struct event_loop *loop;	/* the one its sockets are watched by */
+	struct event_loop own_loop;	/* workers other than 0 */
+	int socket;			/* SO_REUSEPORT, -1 while closed */
+	event_handler readable;
+	struct rx_ring rx;
+	struct tx_queue tx;
+};
+
+struct workers_t {
+	uint32_t count;		/* "workers" in udhcpd.conf, 0 means 1 */
+	struct worker *w;
+};
+
+extern struct workers_t workers;
+
+/* The address pool, who holds each address, and the probes are shared
+ * by every worker. A request is handled with its client's lease shard
+ * locked (lease_shard.h) and takes this only while it needs those. */
+extern pthread_mutex_t server_lock;
+
+/* open every worker's sockets, calling readable(fd, worker) for them.
+ * Worker 0 is added to main, the others start their threads */
+int workers_start(struct event_loop *main, event_handler readable);
+
+/* (re)open w's listening socket, <0 on errors */
+int worker_listen(struct worker *w);
+
+/* stop and join the threads */
+void workers_stop(void);
+
+#endif
@@ -41,8 +41,10 @@
 #include "udhcp/dhcpd.h"
 #include "udhcp/clientpacket.h"
 #include "udhcp/options.h"
+#include "udhcp/option_builder.h"
 #include "udhcp/dhcpc.h"
 #include "udhcp/common.h"
+#include "udhcp/packet_ring.h"
 
 
 /* Create a random xid */
@@ -66,8 +68,8 @@ unsigned long random_xid(void)
 }
 
 
-/* initialize a packet with the proper defaults */
-static void init_packet(struct dhcpMessage *packet, char type)
+/* initialize a packet with the proper defaults, opts appends to it */
+static void init_packet(struct dhcpMessage *packet, struct option_builder *opts, char type)
 {
 	struct vendor  {
 		char vendor, length;
@@ -76,28 +78,29 @@ static void init_packet(struct dhcpMessage *packet, char type)
 
 	init_header(packet, type);
 	memcpy(packet->chaddr, client_config.arp, 6);
-	add_option_string(packet->options, client_config.clientid);
-	if (client_config.hostname) add_option_string(packet->options, client_config.hostname);
-	if (client_config.fqdn) add_option_string(packet->options, client_config.fqdn);
-	add_option_string(packet->options, (uint8_t *) &vendor_id);
+	option_builder_init(opts, packet->options);
+	option_builder_add(opts, client_config.clientid);
+	if (client_config.hostname) option_builder_add(opts, client_config.hostname);
+	if (client_config.fqdn) option_builder_add(opts, client_config.fqdn);
+	option_builder_add(opts, (uint8_t *) &vendor_id);
 }
 
 
 /* Add a parameter request list for stubborn DHCP servers. Pull the data
  * from the struct in options.c. Don't do bounds checking here because it
  * goes towards the head of the packet. */
-static void add_requests(struct dhcpMessage *packet)
+static void add_requests(struct option_builder *opts)
 {
-	int end = end_option(packet->options);
+	uint8_t *option = opts->options + opts->end;
 	int i, len = 0;
 
-	packet->options[end + OPT_CODE] = DHCP_PARAM_REQ;
+	option[OPT_CODE] = DHCP_PARAM_REQ;
 	for (i = 0; dhcp_options[i].code; i++)
 		if (dhcp_options[i].flags & OPTION_REQ)
-			packet->options[end + OPT_DATA + len++] = dhcp_options[i].code;
-	packet->options[end + OPT_LEN] = len;
-	packet->options[end + OPT_DATA + len] = DHCP_END;
-
+			option[OPT_DATA + len++] = dhcp_options[i].code;
+	option[OPT_LEN] = len;
+	option[OPT_DATA + len] = DHCP_END;
+	opts->end += len + 2;
 }
 
 
@@ -105,13 +108,14 @@ static void add_requests(struct dhcpMessage *packet)
 int send_discover(unsigned long xid, unsigned long requested)
 {
 	struct dhcpMessage packet;
+	struct option_builder opts;
 
-	init_packet(&packet, DHCPDISCOVER);
+	init_packet(&packet, &opts, DHCPDISCOVER);
 	packet.xid = xid;
 	if (requested)
-		add_simple_option(packet.options, DHCP_REQUESTED_IP, requested);
+		option_builder_simple(&opts, DHCP_REQUESTED_IP, requested);
 
-	add_requests(&packet);
+	add_requests(&opts);
 	LOG(LOG_DEBUG, "Sending discover...");
 	return raw_packet(&packet, INADDR_ANY, CLIENT_PORT, INADDR_BROADCAST,
 				SERVER_PORT, MAC_BCAST_ADDR, client_config.ifindex);
@@ -122,15 +126,16 @@ int send_discover(unsigned long xid, unsigned long requested)
 int send_selecting(unsigned long xid, unsigned long server, unsigned long requested)
 {
 	struct dhcpMessage packet;
+	struct option_builder opts;
 	struct in_addr addr;
 
-	init_packet(&packet, DHCPREQUEST);
+	init_packet(&packet, &opts, DHCPREQUEST);
 	packet.xid = xid;
 
-	add_simple_option(packet.options, DHCP_REQUESTED_IP, requested);
-	add_simple_option(packet.options, DHCP_SERVER_ID, server);
+	option_builder_simple(&opts, DHCP_REQUESTED_IP, requested);
+	option_builder_simple(&opts, DHCP_SERVER_ID, server);
 
-	add_requests(&packet);
+	add_requests(&opts);
 	addr.s_addr = requested;
 	LOG(LOG_DEBUG, "Sending select for %s...", inet_ntoa(addr));
 	return raw_packet(&packet, INADDR_ANY, CLIENT_PORT, INADDR_BROADCAST,
@@ -142,13 +147,14 @@ int send_selecting(unsigned long xid, unsigned long server, unsigned long reques
 int send_renew(unsigned long xid, unsigned long server, unsigned long ciaddr)
 {
 	struct dhcpMessage packet;
+	struct option_builder opts;
 	int ret = 0;
 
-	init_packet(&packet, DHCPREQUEST);
+	init_packet(&packet, &opts, DHCPREQUEST);
 	packet.xid = xid;
 	packet.ciaddr = ciaddr;
 
-	add_requests(&packet);
+	add_requests(&opts);
 	LOG(LOG_DEBUG, "Sending renew...");
 	if (server)
 		ret = kernel_packet(&packet, ciaddr, CLIENT_PORT, server, SERVER_PORT);
@@ -162,88 +168,108 @@ int send_renew(unsigned long xid, unsigned long server, unsigned long ciaddr)
 int send_release(unsigned long server, unsigned long ciaddr)
 {
 	struct dhcpMessage packet;
+	struct option_builder opts;
 
-	init_packet(&packet, DHCPRELEASE);
+	init_packet(&packet, &opts, DHCPRELEASE);
 	packet.xid = random_xid();
 	packet.ciaddr = ciaddr;
 
-	add_simple_option(packet.options, DHCP_REQUESTED_IP, ciaddr);
-	add_simple_option(packet.options, DHCP_SERVER_ID, server);
+	option_builder_simple(&opts, DHCP_REQUESTED_IP, ciaddr);
+	option_builder_simple(&opts, DHCP_SERVER_ID, server);
 
 	LOG(LOG_DEBUG, "Sending release...");
 	return kernel_packet(&packet, ciaddr, CLIENT_PORT, server, SERVER_PORT);
 }
 
 
-/* return -1 on errors that are fatal for the socket, -2 for those that aren't */
-int get_raw_packet(struct dhcpMessage *payload, int fd)
+/* sanity check a packet off the raw socket and copy out its payload,
+ * csum_ok if the udp checksum was already checked for us */
+static int check_raw_packet(struct dhcpMessage *payload, struct udp_dhcp_packet *packet,
+			    int bytes, int csum_ok)
 {
-	int bytes;
-	struct udp_dhcp_packet packet;
 	uint32_t source, dest;
 	uint16_t check;
 
-	memset(&packet, 0, sizeof(struct udp_dhcp_packet));
-	bytes = read(fd, &packet, sizeof(struct udp_dhcp_packet));
-	if (bytes < 0) {
-		DEBUG(LOG_INFO, "couldn't read on raw listening socket -- ignoring");
-		usleep(500000); /* possible down interface, looping condition */
-		return -1;
-	}
-
 	if (bytes < (int) (sizeof(struct iphdr) + sizeof(struct udphdr))) {
 		DEBUG(LOG_INFO, "message too short, ignoring");
 		return -2;
 	}
 
-	if (bytes < ntohs(packet.ip.tot_len)) {
+	if (bytes < ntohs(packet->ip.tot_len)) {
 		DEBUG(LOG_INFO, "Truncated packet");
 		return -2;
 	}
 
 	/* ignore any extra garbage bytes */
-	bytes = ntohs(packet.ip.tot_len);
+	bytes = ntohs(packet->ip.tot_len);
 
 	/* Make sure its the right packet for us, and that it passes sanity checks */
-	if (packet.ip.protocol != IPPROTO_UDP || packet.ip.version != IPVERSION ||
-	    packet.ip.ihl != sizeof(packet.ip) >> 2 || packet.udp.dest != htons(CLIENT_PORT) ||
+	if (packet->ip.protocol != IPPROTO_UDP || packet->ip.version != IPVERSION ||
+	    packet->ip.ihl != sizeof(packet->ip) >> 2 || packet->udp.dest != htons(CLIENT_PORT) ||
 	    bytes > (int) sizeof(struct udp_dhcp_packet) ||
-	    ntohs(packet.udp.len) != (uint16_t) (bytes - sizeof(packet.ip))) {
+	    ntohs(packet->udp.len) != (uint16_t) (bytes - sizeof(packet->ip))) {
 	    	DEBUG(LOG_INFO, "unrelated/bogus packet");
 	    	return -2;
 	}
 
 	/* check IP checksum */
-	check = packet.ip.check;
-	packet.ip.check = 0;
-	if (check != checksum(&(packet.ip), sizeof(packet.ip))) {
+	check = packet->ip.check;
+	packet->ip.check = 0;
+	if (check != checksum(&(packet->ip), sizeof(packet->ip))) {
 		DEBUG(LOG_INFO, "bad IP header checksum, ignoring");
 		return -1;
 	}
 
 	/* verify the UDP checksum by replacing the header with a psuedo header */
-	source = packet.ip.saddr;
-	dest = packet.ip.daddr;
-	check = packet.udp.check;
-	packet.udp.check = 0;
-	memset(&packet.ip, 0, sizeof(packet.ip));
-
-	packet.ip.protocol = IPPROTO_UDP;
-	packet.ip.saddr = source;
-	packet.ip.daddr = dest;
-	packet.ip.tot_len = packet.udp.len; /* cheat on the psuedo-header */
-	if (check && check != checksum(&packet, bytes)) {
+	source = packet->ip.saddr;
+	dest = packet->ip.daddr;
+	check = packet->udp.check;
+	packet->udp.check = 0;
+	memset(&packet->ip, 0, sizeof(packet->ip));
+
+	packet->ip.protocol = IPPROTO_UDP;
+	packet->ip.saddr = source;
+	packet->ip.daddr = dest;
+	packet->ip.tot_len = packet->udp.len; /* cheat on the psuedo-header */
+	if (check && !csum_ok && check != checksum(packet, bytes)) {
 		DEBUG(LOG_ERR, "packet with bad UDP checksum received, ignoring");
 		return -2;
 	}
 
-	memcpy(payload, &(packet.data), bytes - (sizeof(packet.ip) + sizeof(packet.udp)));
+	memcpy(payload, &(packet->data), bytes - (sizeof(packet->ip) + sizeof(packet->udp)));
 
 	if (ntohl(payload->cookie) != DHCP_MAGIC) {
 		LOG(LOG_ERR, "received bogus message (bad magic) -- ignoring");
 		return -2;
 	}
 	DEBUG(LOG_INFO, "oooooh!!! got some!");
-	return bytes - (sizeof(packet.ip) + sizeof(packet.udp));
+	return bytes - (sizeof(packet->ip) + sizeof(packet->udp));
+
+}
+
+
+/* return -1 on errors that are fatal for the socket, -2 for those that aren't */
+int get_raw_packet(struct dhcpMessage *payload, int fd)
+{
+	int bytes;
+	struct udp_dhcp_packet packet;
+	uint8_t *frame;
+
+	/* checked in place, the ring block stays ours until the next call */
+	if (raw_ring.map && raw_ring.fd == fd) {
+		if (!(frame = packet_ring_recv(&raw_ring, &bytes)))
+			return -2;
+		return check_raw_packet(payload, (struct udp_dhcp_packet *) frame, bytes,
+					packet_ring_csum_ok(&raw_ring));
+	}
+
+	memset(&packet, 0, sizeof(struct udp_dhcp_packet));
+	bytes = read(fd, &packet, sizeof(struct udp_dhcp_packet));
+	if (bytes < 0) {
+		DEBUG(LOG_INFO, "couldn't read on raw listening socket -- ignoring");
+		usleep(500000); /* possible down interface, looping condition */
+		return -1;
+	}
 
+	return check_raw_packet(payload, &packet, bytes, 0);
 }
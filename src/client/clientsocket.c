@@ -36,6 +36,9 @@
 
 #include "udhcp/clientsocket.h"
 #include "udhcp/common.h"
+#include "udhcp/packet_ring.h"
+
+struct packet_ring raw_ring;
 
 
 int raw_socket(int ifindex)
@@ -58,5 +61,10 @@ int raw_socket(int ifindex)
 		return -1;
 	}
 
+	/* the previous raw socket's ring, if any, went with it */
+	packet_ring_close(&raw_ring);
+	if (packet_mmap && packet_ring_rx(&raw_ring, fd) < 0)
+		LOG(LOG_WARNING, "Reading the raw socket without a ring");
+
 	return fd;
 }
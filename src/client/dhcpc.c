@@ -43,6 +43,7 @@
 #include "udhcp/socket.h"
 #include "udhcp/common.h"
 #include "udhcp/signalpipe.h"
+#include "udhcp/packet_ring.h"
 
 static int state;
 static unsigned long requested_ip; /* = 0 */
@@ -85,6 +86,7 @@ static void __attribute__ ((noreturn)) show_usage(void)
 "  -b, --background                Fork to background if lease cannot be\n"
 "                                  immediately negotiated.\n"
 "  -i, --interface=INTERFACE       Interface to use (default: eth0)\n"
+"  -m, --mmap                      Read the raw socket through a packet ring\n"
 "  -n, --now                       Exit with failure if lease cannot be\n"
 "                                  immediately negotiated.\n"
 "  -p, --pidfile=file              Store process ID of daemon in file\n"
@@ -202,6 +204,7 @@ int main(int argc, char *argv[])
 		{"hostname",	required_argument,	0, 'h'},
 		{"fqdn",	required_argument,	0, 'F'},
 		{"interface",	required_argument,	0, 'i'},
+		{"mmap",	no_argument,		0, 'm'},
 		{"now", 	no_argument,		0, 'n'},
 		{"pidfile",	required_argument,	0, 'p'},
 		{"quit",	no_argument,		0, 'q'},
@@ -214,7 +217,7 @@ int main(int argc, char *argv[])
 	/* get options */
 	while (1) {
 		int option_index = 0;
-		c = getopt_long(argc, argv, "c:fbH:h:F:i:np:qr:s:v", arg_options, &option_index);
+		c = getopt_long(argc, argv, "c:fbH:h:F:i:mnp:qr:s:v", arg_options, &option_index);
 		if (c == -1) break;
 
 		switch (c) {
@@ -262,6 +265,9 @@ int main(int argc, char *argv[])
 		case 'i':
 			client_config.interface =  optarg;
 			break;
+		case 'm':
+			packet_mmap = 1;
+			break;
 		case 'n':
 			client_config.abort_if_no_lease = 1;
 			break;
@@ -0,0 +1,194 @@
+/*
+ * checksum.c -- the internet checksum (RFC 1071)
+ *
+ * Every raw frame the server sends and the client receives is summed
+ * twice, the ip header and the whole udp datagram. The sum used to be
+ * taken a 16 bit word at a time into 32 bits. It is now taken 32 bits
+ * at a time into 64 bits, and on x86 with SSE2 or AVX2 when the CPU
+ * has them, picked on the first call. The one's complement sum doesn't
+ * care how the words are grouped, so all of them give the same result.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "udhcp/checksum.h"
+
+#ifdef CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+/* below this the vector loops don't pay for themselves, the ip header
+ * is always summed with the scalar loop */
+#define VECTOR_MIN	64
+
+/* vector blocks summed into 32 bit lanes before they are added to the
+ * 64 bit sum, each lane takes one word a block so they can't overflow */
+#define VECTOR_CHUNK	32768
+
+
+static uint64_t sum_scalar(const uint8_t *p, int count, uint64_t sum)
+{
+	uint32_t a, b;
+	uint16_t tmp;
+
+	while (count >= 8) {
+		memcpy(&a, p, 4);
+		memcpy(&b, p + 4, 4);
+		sum += a;
+		sum += b;
+		p += 8;
+		count -= 8;
+	}
+	if (count >= 4) {
+		memcpy(&a, p, 4);
+		sum += a;
+		p += 4;
+		count -= 4;
+	}
+	if (count >= 2) {
+		memcpy(&tmp, p, 2);
+		sum += tmp;
+		p += 2;
+		count -= 2;
+	}
+
+	/* Make sure that the left-over byte is added correctly both
+	 * with little and big endian hosts */
+	if (count > 0) {
+		tmp = 0;
+		*(uint8_t *) (&tmp) = *p;
+		sum += tmp;
+	}
+	return sum;
+}
+
+
+static uint16_t fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+
+uint16_t checksum_scalar(void *addr, int count)
+{
+	return fold(sum_scalar(addr, count, 0));
+}
+
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint8_t *p, int count, uint64_t sum)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo, hi, v;
+	uint32_t lanes[4];
+	int n;
+
+	while (count >= 16) {
+		lo = hi = zero;
+		/* words widened to 32 bit lanes, x86 is little endian */
+		for (n = 0; n < VECTOR_CHUNK && count >= 16; n++) {
+			v = _mm_loadu_si128((const __m128i *) p);
+			lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(v, zero));
+			hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(v, zero));
+			p += 16;
+			count -= 16;
+		}
+		_mm_storeu_si128((__m128i *) lanes, lo);
+		sum += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		_mm_storeu_si128((__m128i *) lanes, hi);
+		sum += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+	return sum_scalar(p, count, sum);
+}
+
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *p, int count, uint64_t sum)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo, hi, v;
+	uint32_t lanes[8];
+	int n, i;
+
+	while (count >= 32) {
+		lo = hi = zero;
+		for (n = 0; n < VECTOR_CHUNK && count >= 32; n++) {
+			v = _mm256_loadu_si256((const __m256i *) p);
+			lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(v, zero));
+			hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(v, zero));
+			p += 32;
+			count -= 32;
+		}
+		_mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi32(lo, hi));
+		/* lo + hi is two words a lane, still short of overflowing */
+		for (i = 0; i < 8; i++)
+			sum += lanes[i];
+	}
+	return sum_sse2(p, count, sum);
+}
+
+
+int checksum_have_sse2(void)
+{
+#ifdef __x86_64__
+	return 1;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+
+int checksum_have_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+
+uint16_t checksum_sse2(void *addr, int count)
+{
+	return fold(sum_sse2(addr, count, 0));
+}
+
+
+uint16_t checksum_avx2(void *addr, int count)
+{
+	return fold(sum_avx2(addr, count, 0));
+}
+#endif
+
+
+static uint64_t sum_pick(const uint8_t *p, int count, uint64_t sum);
+
+/* the best of the above, set by the first call. Threads racing on it
+ * all store the same pointer */
+static uint64_t (*sum_vector)(const uint8_t *p, int count, uint64_t sum) = sum_pick;
+
+static uint64_t sum_pick(const uint8_t *p, int count, uint64_t sum)
+{
+#ifdef CHECKSUM_X86
+	if (checksum_have_avx2())
+		sum_vector = sum_avx2;
+	else if (checksum_have_sse2())
+		sum_vector = sum_sse2;
+	else
+#endif
+		sum_vector = sum_scalar;
+	return sum_vector(p, count, sum);
+}
+
+
+uint16_t checksum(void *addr, int count)
+{
+	/* Compute Internet Checksum for "count" bytes
+	 *         beginning at location "addr".
+	 */
+	if (count < VECTOR_MIN)
+		return fold(sum_scalar(addr, count, 0));
+	return fold(sum_vector(addr, count, 0));
+}
@@ -0,0 +1,175 @@
+/*
+ * event.c -- epoll based event loop
+ *
+ * Replaces the select() loop that could only watch the signal pipe
+ * and one socket. Any number of fds can be registered with a handler,
+ * and deadlines are timerfds registered the same way, so the daemon
+ * sleeps in a single epoll_wait() until something has work to do.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "udhcp/common.h"
+#include "udhcp/event.h"
+
+
+static void woken(int fd, void *arg)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0)
+		DEBUG(LOG_ERR, "Could not read wakeup: %m");
+}
+
+
+int event_loop_init(struct event_loop *loop)
+{
+	memset(loop, 0, sizeof(struct event_loop));
+	loop->wake = -1;
+	loop->running = 1;	/* so a stop before run sticks */
+	if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		LOG(LOG_ERR, "Could not create epoll fd: %m");
+		return -1;
+	}
+	/* lets another thread stop the loop */
+	if ((loop->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+	    event_add(loop, loop->wake, woken, NULL) < 0) {
+		LOG(LOG_ERR, "Could not create wakeup fd: %m");
+		return -1;
+	}
+	return 0;
+}
+
+
+void event_loop_close(struct event_loop *loop)
+{
+	int fd;
+
+	for (fd = 0; fd < loop->size; fd++)
+		if (loop->sources[fd].handler && loop->sources[fd].timer)
+			close(fd);
+	if (loop->wake >= 0) close(loop->wake);
+	close(loop->epfd);
+	free(loop->sources);
+	memset(loop, 0, sizeof(struct event_loop));
+	loop->epfd = -1;
+}
+
+
+static int watch(struct event_loop *loop, int fd, event_handler handler, void *arg, int timer)
+{
+	struct epoll_event ev;
+	int size;
+
+	if (fd >= loop->size) {
+		size = loop->size ? loop->size : 16;
+		while (size <= fd) size *= 2;
+		loop->sources = xrealloc(loop->sources, size * sizeof(struct event_source));
+		memset(loop->sources + loop->size, 0,
+		       (size - loop->size) * sizeof(struct event_source));
+		loop->size = size;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(loop->epfd, loop->sources[fd].handler ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		      fd, &ev) < 0) {
+		LOG(LOG_ERR, "Could not watch fd %d: %m", fd);
+		return -1;
+	}
+
+	loop->sources[fd].handler = handler;
+	loop->sources[fd].arg = arg;
+	loop->sources[fd].timer = timer;
+	return 0;
+}
+
+
+int event_add(struct event_loop *loop, int fd, event_handler handler, void *arg)
+{
+	return watch(loop, fd, handler, arg, 0);
+}
+
+
+void event_del(struct event_loop *loop, int fd)
+{
+	if (fd < 0 || fd >= loop->size || !loop->sources[fd].handler)
+		return;
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+	loop->sources[fd].handler = NULL;
+}
+
+
+int event_timer_new(struct event_loop *loop, event_handler handler, void *arg)
+{
+	int fd;
+
+	if ((fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		LOG(LOG_ERR, "Could not create timer: %m");
+		return -1;
+	}
+	if (watch(loop, fd, handler, arg, 1) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+void event_timer_set(int fd, time_t when, unsigned long interval)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when;
+	its.it_interval.tv_sec = when ? interval : 0;
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		DEBUG(LOG_ERR, "Could not set timer: %m");
+}
+
+
+void event_loop_run(struct event_loop *loop)
+{
+	struct epoll_event events[EVENT_BATCH];
+	struct event_source *src;
+	uint64_t expirations;
+	int i, n, fd;
+
+	while (loop->running) {
+		if ((n = epoll_wait(loop->epfd, events, EVENT_BATCH, -1)) < 0) {
+			if (errno != EINTR) {
+				LOG(LOG_ERR, "epoll_wait failed: %m");
+				return;
+			}
+			continue;
+		}
+
+		for (i = 0; i < n && loop->running; i++) {
+			/* an earlier handler may have dropped this fd */
+			fd = events[i].data.fd;
+			if (fd >= loop->size || !(src = &loop->sources[fd])->handler)
+				continue;
+			if (src->timer && read(fd, &expirations, sizeof(expirations)) < 0)
+				continue;	/* rearmed since it fired */
+			src->handler(fd, src->arg);
+		}
+	}
+}
+
+
+void event_loop_stop(struct event_loop *loop)
+{
+	uint64_t one = 1;
+
+	loop->running = 0;
+	if (write(loop->wake, &one, sizeof(one)) < 0)
+		DEBUG(LOG_ERR, "Could not wake event loop: %m");
+}
@@ -0,0 +1,149 @@
+/*
+ * lease_db.c -- the lease file format
+ *
+ * The lease file used to be a bare run of struct dhcpOfferedAddr, read
+ * back with an fread() per lease, and with nothing to tell whether its
+ * times were remaining or absolute. It now starts with a versioned
+ * header and ends with a chaddr index, and is read through a mapping:
+ * udhcpd loads the records in place and dumpleases looks a client up
+ * without reading the rest.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "udhcp/lease_db.h"
+
+
+static uint32_t hash_chaddr(uint8_t *chaddr)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	/* FNV-1a, the file must read the same on every host */
+	for (i = 0; i < 16; i++)
+		h = (h ^ chaddr[i]) * 16777619u;
+	return h;
+}
+
+
+static int blank(uint8_t *chaddr)
+{
+	static const uint8_t none[16];
+
+	return !memcmp(chaddr, none, 16);
+}
+
+
+int lease_db_open(struct lease_db *db, const char *file)
+{
+	struct stat st;
+	struct lease_db_header *h;
+	uint64_t need;
+	int fd;
+
+	memset(db, 0, sizeof(struct lease_db));
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t) st.st_size < sizeof(struct lease_db_header)) {
+		close(fd);
+		return -2;
+	}
+
+	db->size = st.st_size;
+	db->map = mmap(NULL, db->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (db->map == MAP_FAILED) {
+		db->map = NULL;
+		return -1;
+	}
+
+	h = db->header = (struct lease_db_header *) db->map;
+	db->count = ntohl(h->count);
+	db->slots = ntohl(h->index_slots);
+	db->flags = ntohl(h->flags);
+	need = sizeof(struct lease_db_header) +
+	       (uint64_t) db->count * sizeof(struct dhcpOfferedAddr) + (uint64_t) db->slots * 4;
+	if (memcmp(h->magic, LEASE_DB_MAGIC, sizeof(h->magic)) ||
+	    ntohl(h->version) != LEASE_DB_VERSION ||
+	    ntohl(h->record_size) != sizeof(struct dhcpOfferedAddr) ||
+	    !db->slots || (db->slots & (db->slots - 1)) || need > db->size) {
+		lease_db_close(db);
+		return -2;
+	}
+
+	db->records = (struct dhcpOfferedAddr *) (db->map + sizeof(struct lease_db_header));
+	db->index = (uint32_t *) (db->records + db->count);
+	madvise(db->map, db->size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+
+void lease_db_close(struct lease_db *db)
+{
+	if (db->map) munmap(db->map, db->size);
+	db->map = NULL;
+}
+
+
+struct dhcpOfferedAddr *lease_db_find(struct lease_db *db, uint8_t *chaddr)
+{
+	uint32_t i, n, probes;
+
+	if (blank(chaddr)) return NULL;
+
+	i = hash_chaddr(chaddr) & (db->slots - 1);
+	for (probes = 0; probes < db->slots; probes++, i = (i + 1) & (db->slots - 1)) {
+		if ((n = ntohl(db->index[i])) == LEASE_DB_EMPTY)
+			return NULL;
+		/* a damaged index only costs the lookup */
+		if (n < db->count && !memcmp(db->records[n].chaddr, chaddr, 16))
+			return &db->records[n];
+	}
+	return NULL;
+}
+
+
+int lease_db_write(FILE *fp, struct dhcpOfferedAddr *records, uint32_t count, uint32_t flags)
+{
+	struct lease_db_header h;
+	uint32_t *index, slots = 8, n, i;
+
+	/* at most half full */
+	while (slots < 2 * count) slots <<= 1;
+	if (!(index = malloc(slots * 4)))
+		return -1;
+	memset(index, 0xff, slots * 4);
+	for (n = 0; n < count; n++) {
+		if (blank(records[n].chaddr)) continue;
+		for (i = hash_chaddr(records[n].chaddr) & (slots - 1); index[i] != LEASE_DB_EMPTY;
+		     i = (i + 1) & (slots - 1));
+		index[i] = htonl(n);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, LEASE_DB_MAGIC, sizeof(h.magic));
+	h.version = htonl(LEASE_DB_VERSION);
+	h.flags = htonl(flags);
+	h.record_size = htonl(sizeof(struct dhcpOfferedAddr));
+	h.count = htonl(count);
+	h.index_slots = htonl(slots);
+	h.written = htonl(time(0));
+
+	n = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+	    fwrite(records, sizeof(struct dhcpOfferedAddr), count, fp) == count &&
+	    fwrite(index, 4, slots, fp) == slots;
+	free(index);
+	return n ? 0 : -1;
+}
@@ -10,13 +10,15 @@
 #include "udhcp/files.h"
 #include "udhcp/options.h"
 #include "udhcp/common.h"
+#include "udhcp/option_index.h"
+#include "udhcp/option_builder.h"
 
 #ifdef DHCPsql
 #include <mysql.h>
 #include <arpa/inet.h>
 #endif
 
-/* supported options are easily added here */
+/* supported options are easily added here, keep them sorted by code */
 struct dhcp_option dhcp_options[] = {
 	/* name[10]	flags					code */
 	{"subnet",	OPTION_IP | OPTION_REQ,			0x01},
@@ -64,58 +66,73 @@ int option_lengths[] = {
 };
 
 
-/* get an option with bounds checking (warning, not aligned). */
-uint8_t *get_option(struct dhcpMessage *packet, int code)
+/* index every option of packet, checking that each fits in its field
+ * (warning, the data is not aligned) */
+int option_index_build(struct option_index *idx, struct dhcpMessage *packet)
 {
-	int i, length;
+	int i, length, code, len;
 	uint8_t *optionptr;
-	int over = 0, done = 0, curr = OPTION_FIELD;
+	int over = 0, curr = OPTION_FIELD;
 
+	memset(idx->off, 0, sizeof(idx->off));
 	optionptr = packet->options;
 	i = 0;
 	length = 308;
-	while (!done) {
+	for (;;) {
 		if (i >= length) {
 			LOG(LOG_WARNING, "bogus packet, option fields too long.");
-			return NULL;
+			return -1;
 		}
-		if (optionptr[i + OPT_CODE] == code) {
-			if (i + 1 + optionptr[i + OPT_LEN] >= length) {
-				LOG(LOG_WARNING, "bogus packet, option fields too long.");
-				return NULL;
-			}
-			return optionptr + i + 2;
-		}
-		switch (optionptr[i + OPT_CODE]) {
-		case DHCP_PADDING:
+		code = optionptr[i + OPT_CODE];
+		if (code == DHCP_PADDING) {
 			i++;
-			break;
-		case DHCP_OPTION_OVER:
-			if (i + 1 + optionptr[i + OPT_LEN] >= length) {
-				LOG(LOG_WARNING, "bogus packet, option fields too long.");
-				return NULL;
-			}
-			over = optionptr[i + 3];
-			i += optionptr[OPT_LEN] + 2;
-			break;
-		case DHCP_END:
+			continue;
+		}
+		if (code == DHCP_END) {
 			if (curr == OPTION_FIELD && over & FILE_FIELD) {
 				optionptr = packet->file;
-				i = 0;
 				length = 128;
 				curr = FILE_FIELD;
-			} else if (curr == FILE_FIELD && over & SNAME_FIELD) {
+			} else if (curr != SNAME_FIELD && over & SNAME_FIELD) {
 				optionptr = packet->sname;
-				i = 0;
 				length = 64;
 				curr = SNAME_FIELD;
-			} else done = 1;
-			break;
-		default:
-			i += optionptr[OPT_LEN + i] + 2;
+			} else return 0;
+			i = 0;
+			continue;
+		}
+
+		/* the length byte and the data both inside the field */
+		if (i + 1 >= length || i + 2 + (len = optionptr[i + OPT_LEN]) > length) {
+			LOG(LOG_WARNING, "bogus packet, option fields too long.");
+			return -1;
+		}
+		if (!idx->off[code]) {
+			idx->off[code] = optionptr + i + 2 - (uint8_t *) packet;
+			idx->len[code] = len;
 		}
+		/* only honoured in the options field itself */
+		if (code == DHCP_OPTION_OVER && curr == OPTION_FIELD && len)
+			over = optionptr[i + 2];
+		i += len + 2;
 	}
-	return NULL;
+}
+
+
+uint8_t *option_index_get(struct option_index *idx, struct dhcpMessage *packet, int code)
+{
+	if (!idx->off[code & 0xff]) return NULL;
+	return (uint8_t *) packet + idx->off[code & 0xff];
+}
+
+
+/* get an option with bounds checking (warning, not aligned). */
+uint8_t *get_option(struct dhcpMessage *packet, int code)
+{
+	struct option_index idx;
+
+	option_index_build(&idx, packet);
+	return option_index_get(&idx, packet, code);
 }
 
 
@@ -132,21 +149,52 @@ int end_option(uint8_t *optionptr)
 }
 
 
-/* add an option string to the options (an option string contains an option code,
- * length, then data) */
-int add_option_string(uint8_t *optionptr, uint8_t *string)
+void option_builder_init(struct option_builder *b, uint8_t *options)
+{
+	b->options = options;
+	b->size = 308;
+	option_builder_sync(b);
+}
+
+
+void option_builder_sync(struct option_builder *b)
+{
+	b->end = end_option(b->options);
+}
+
+
+int option_builder_append(struct option_builder *b, uint8_t *data, int len)
 {
-	int end = end_option(optionptr);
+	/* end position + options + end option */
+	if (b->end + len + 1 >= b->size)
+		return 0;
+	memcpy(b->options + b->end, data, len);
+	b->end += len;
+	b->options[b->end] = DHCP_END;
+	return len;
+}
 
+
+int option_builder_add(struct option_builder *b, uint8_t *string)
+{
 	/* end position + string length + option code/length + end option */
-	if (end + string[OPT_LEN] + 2 + 1 >= 308) {
+	if (b->end + string[OPT_LEN] + 2 + 1 >= b->size) {
 		LOG(LOG_ERR, "Option 0x%02x did not fit into the packet!", string[OPT_CODE]);
 		return 0;
 	}
 	DEBUG(LOG_INFO, "adding option 0x%02x", string[OPT_CODE]);
-	memcpy(optionptr + end, string, string[OPT_LEN] + 2);
-	optionptr[end + string[OPT_LEN] + 2] = DHCP_END;
-	return string[OPT_LEN] + 2;
+	return option_builder_append(b, string, string[OPT_LEN] + 2);
+}
+
+
+/* add an option string to the options (an option string contains an option code,
+ * length, then data) */
+int add_option_string(uint8_t *optionptr, uint8_t *string)
+{
+	struct option_builder b;
+
+	option_builder_init(&b, optionptr);
+	return option_builder_add(&b, string);
 }
 
 #ifdef DHCPsql
@@ -162,7 +210,6 @@ int add_option_row(uint8_t *optionptr, MYSQL_ROW row)
 	int n;
 	char *ip;
 	int length = 0;
-	int end = end_option(optionptr);
 	char option[255];
 	struct in_addr addr;
 
@@ -247,11 +294,28 @@ int add_option_row(uint8_t *optionptr, MYSQL_ROW row)
 #endif
 
 
-/* add a one to four byte option to a packet */
-int add_simple_option(uint8_t *optionptr, uint8_t code, uint32_t data)
+/* length of a one to four byte option, 0 for codes dhcp_options[]
+ * doesn't know */
+static int simple_length(uint8_t code)
 {
-	char length = 0;
-	int i;
+	int lo = 0, hi = sizeof(dhcp_options) / sizeof(dhcp_options[0]) - 1, mid;
+
+	/* the table is sorted, the empty entry at its end left out */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (dhcp_options[mid].code < code) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo < (int) (sizeof(dhcp_options) / sizeof(dhcp_options[0])) - 1 &&
+	    dhcp_options[lo].code == code)
+		return option_lengths[dhcp_options[lo].flags & TYPE_MASK];
+	return 0;
+}
+
+
+int option_builder_simple(struct option_builder *b, uint8_t code, uint32_t data)
+{
+	int length;
 	uint8_t option[2 + 4];
 	uint8_t *u8;
 	uint16_t *u16;
@@ -261,12 +325,7 @@ int add_simple_option(uint8_t *optionptr, uint8_t code, uint32_t data)
 	u16 = (uint16_t *) &aligned;
 	u32 = &aligned;
 
-	for (i = 0; dhcp_options[i].code; i++)
-		if (dhcp_options[i].code == code) {
-			length = option_lengths[dhcp_options[i].flags & TYPE_MASK];
-		}
-
-	if (!length) {
+	if (!(length = simple_length(code))) {
 		DEBUG(LOG_ERR, "Could not add option 0x%02x", code);
 		return 0;
 	}
@@ -280,7 +339,17 @@ int add_simple_option(uint8_t *optionptr, uint8_t code, uint32_t data)
 		case 4: *u32 = data; break;
 	}
 	memcpy(option + 2, &aligned, length);
-	return add_option_string(optionptr, option);
+	return option_builder_add(b, option);
+}
+
+
+/* add a one to four byte option to a packet */
+int add_simple_option(uint8_t *optionptr, uint8_t code, uint32_t data)
+{
+	struct option_builder b;
+
+	option_builder_init(&b, optionptr);
+	return option_builder_simple(&b, code, data);
 }
 
 
@@ -15,6 +15,8 @@
 #include <errno.h>
 
 #include "udhcp/packet.h"
+#include "udhcp/packet_batch.h"
+#include "udhcp/checksum.h"
 #include "udhcp/dhcpd.h"
 #include "udhcp/options.h"
 #include "udhcp/common.h"
@@ -43,10 +45,10 @@ void init_header(struct dhcpMessage *packet, char type)
 }
 
 
-/* read a packet from socket fd, return -1 on read error, -2 on packet error */
-int get_packet(struct dhcpMessage *packet, int fd)
+/* sanity check a packet that was just read and index its options, -2
+ * if it is no good */
+static int check_packet(struct dhcpMessage *packet, int bytes, struct option_index *idx)
 {
-	int bytes;
 	int i;
 	const char broken_vendors[][8] = {
 		"MSFT 98",
@@ -54,20 +56,14 @@ int get_packet(struct dhcpMessage *packet, int fd)
 	};
 	char unsigned *vendor;
 
-	memset(packet, 0, sizeof(struct dhcpMessage));
-	bytes = read(fd, packet, sizeof(struct dhcpMessage));
-	if (bytes < 0) {
-		DEBUG(LOG_INFO, "couldn't read on listening socket, ignoring");
-		return -1;
-	}
-
 	if (ntohl(packet->cookie) != DHCP_MAGIC) {
 		LOG(LOG_ERR, "received bogus message, ignoring");
 		return -2;
 	}
 	DEBUG(LOG_INFO, "Received a packet");
 
-	if (packet->op == BOOTREQUEST && (vendor = get_option(packet, DHCP_VENDOR))) {
+	option_index_build(idx, packet);
+	if (packet->op == BOOTREQUEST && (vendor = option_index_get(idx, packet, DHCP_VENDOR))) {
 		for (i = 0; broken_vendors[i][0]; i++) {
 			if (vendor[OPT_LEN - 2] == (uint8_t) strlen(broken_vendors[i]) &&
 			    !strncmp(vendor, broken_vendors[i], vendor[OPT_LEN - 2])) {
@@ -83,33 +79,84 @@ int get_packet(struct dhcpMessage *packet, int fd)
 }
 
 
-uint16_t checksum(void *addr, int count)
+/* read a packet from socket fd, return -1 on read error, -2 on packet error */
+int get_packet(struct dhcpMessage *packet, int fd)
 {
-	/* Compute Internet Checksum for "count" bytes
-	 *         beginning at location "addr".
-	 */
-	register int32_t sum = 0;
-	uint16_t *source = (uint16_t *) addr;
+	struct option_index idx;
+	int bytes;
 
-	while (count > 1)  {
-		/*  This is the inner loop */
-		sum += *source++;
-		count -= 2;
+	memset(packet, 0, sizeof(struct dhcpMessage));
+	bytes = read(fd, packet, sizeof(struct dhcpMessage));
+	if (bytes < 0) {
+		DEBUG(LOG_INFO, "couldn't read on listening socket, ignoring");
+		return -1;
 	}
 
-	/*  Add left-over byte, if any */
-	if (count > 0) {
-		/* Make sure that the left-over byte is added correctly both
-		 * with little and big endian hosts */
-		uint16_t tmp = 0;
-		*(uint8_t *) (&tmp) = * (uint8_t *) source;
-		sum += tmp;
+	return check_packet(packet, bytes, &idx);
+}
+
+
+void rx_ring_init(struct rx_ring *ring)
+{
+	int i;
+
+	memset(ring, 0, sizeof(struct rx_ring));
+	for (i = 0; i < RX_BATCH; i++) {
+		ring->iov[i].iov_base = &ring->packets[i];
+		ring->iov[i].iov_len = sizeof(struct dhcpMessage);
+		ring->msgs[i].msg_hdr.msg_iov = &ring->iov[i];
+		ring->msgs[i].msg_hdr.msg_iovlen = 1;
 	}
-	/*  Fold 32-bit sum to 16 bits */
-	while (sum >> 16)
-		sum = (sum & 0xffff) + (sum >> 16);
+}
+
 
-	return ~sum;
+/* read the datagrams waiting on fd, up to RX_BATCH, without blocking.
+ * Returns how many were read (0 if none), -1 on read error. Packets
+ * that fail the checks get bytes[i] = -2 */
+int get_packets(struct rx_ring *ring, int fd)
+{
+	int n, i;
+
+	n = recvmmsg(fd, ring->msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		DEBUG(LOG_INFO, "couldn't read on listening socket, ignoring");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		/* only clear what the datagram didn't overwrite */
+		ring->bytes[i] = ring->msgs[i].msg_len;
+		memset((uint8_t *) &ring->packets[i] + ring->bytes[i], 0,
+		       sizeof(struct dhcpMessage) - ring->bytes[i]);
+		ring->bytes[i] = check_packet(&ring->packets[i], ring->bytes[i], &ring->index[i]);
+	}
+	return n;
+}
+
+
+/* wrap payload in the ip/udp headers raw_packet() sends */
+static void build_udp_packet(struct udp_dhcp_packet *packet, struct dhcpMessage *payload,
+			     uint32_t source_ip, int source_port, uint32_t dest_ip, int dest_port)
+{
+	memset(packet, 0, sizeof(struct udp_dhcp_packet));
+
+	packet->ip.protocol = IPPROTO_UDP;
+	packet->ip.saddr = source_ip;
+	packet->ip.daddr = dest_ip;
+	packet->udp.source = htons(source_port);
+	packet->udp.dest = htons(dest_port);
+	packet->udp.len = htons(sizeof(packet->udp) + sizeof(struct dhcpMessage)); /* cheat on the psuedo-header */
+	packet->ip.tot_len = packet->udp.len;
+	memcpy(&(packet->data), payload, sizeof(struct dhcpMessage));
+	packet->udp.check = checksum(packet, sizeof(struct udp_dhcp_packet));
+
+	packet->ip.tot_len = htons(sizeof(struct udp_dhcp_packet));
+	packet->ip.ihl = sizeof(packet->ip) >> 2;
+	packet->ip.version = IPVERSION;
+	packet->ip.ttl = IPDEFTTL;
+	packet->ip.check = checksum(&(packet->ip), sizeof(packet->ip));
 }
 
 
@@ -128,7 +175,6 @@ int raw_packet(struct dhcpMessage *payload, uint32_t source_ip, int source_port,
 	}
 
 	memset(&dest, 0, sizeof(dest));
-	memset(&packet, 0, sizeof(packet));
 
 	dest.sll_family = AF_PACKET;
 	dest.sll_protocol = htons(ETH_P_IP);
@@ -141,21 +187,7 @@ int raw_packet(struct dhcpMessage *payload, uint32_t source_ip, int source_port,
 		return -1;
 	}
 
-	packet.ip.protocol = IPPROTO_UDP;
-	packet.ip.saddr = source_ip;
-	packet.ip.daddr = dest_ip;
-	packet.udp.source = htons(source_port);
-	packet.udp.dest = htons(dest_port);
-	packet.udp.len = htons(sizeof(packet.udp) + sizeof(struct dhcpMessage)); /* cheat on the psuedo-header */
-	packet.ip.tot_len = packet.udp.len;
-	memcpy(&(packet.data), payload, sizeof(struct dhcpMessage));
-	packet.udp.check = checksum(&packet, sizeof(struct udp_dhcp_packet));
-
-	packet.ip.tot_len = htons(sizeof(struct udp_dhcp_packet));
-	packet.ip.ihl = sizeof(packet.ip) >> 2;
-	packet.ip.version = IPVERSION;
-	packet.ip.ttl = IPDEFTTL;
-	packet.ip.check = checksum(&(packet.ip), sizeof(packet.ip));
+	build_udp_packet(&packet, payload, source_ip, source_port, dest_ip, dest_port);
 
 	result = sendto(fd, &packet, sizeof(struct udp_dhcp_packet), 0, (struct sockaddr *) &dest, sizeof(dest));
 	if (result <= 0) {
@@ -200,3 +232,201 @@ int kernel_packet(struct dhcpMessage *payload, uint32_t source_ip, int source_po
 	close(fd);
 	return result;
 }
+
+
+int tx_queue_init(struct tx_queue *q, uint32_t source_ip, int source_port, int ifindex,
+		  int reuseport)
+{
+	struct sockaddr_in addr;
+	int n = 1, i;
+
+	memset(q, 0, sizeof(struct tx_queue));
+	q->ring_fd = -1;
+	q->source_ip = source_ip;
+	q->source_port = source_port;
+	q->ifindex = ifindex;
+	for (i = 0; i < TX_BATCH; i++) {
+		q->raw_iov[i].iov_base = &q->raw[i];
+		q->raw_iov[i].iov_len = sizeof(struct udp_dhcp_packet);
+		q->raw_msgs[i].msg_hdr.msg_iov = &q->raw_iov[i];
+		q->raw_msgs[i].msg_hdr.msg_iovlen = 1;
+		q->raw_msgs[i].msg_hdr.msg_name = &q->raw_dest[i];
+		q->raw_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+
+		q->udp_iov[i].iov_base = &q->udp[i];
+		q->udp_iov[i].iov_len = sizeof(struct dhcpMessage);
+		q->udp_msgs[i].msg_hdr.msg_iov = &q->udp_iov[i];
+		q->udp_msgs[i].msg_hdr.msg_iovlen = 1;
+		q->udp_msgs[i].msg_hdr.msg_name = &q->udp_dest[i];
+		q->udp_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	/* protocol 0 keeps the kernel from queueing received frames on it */
+	if ((q->raw_fd = socket(PF_PACKET, SOCK_DGRAM, 0)) < 0)
+		DEBUG(LOG_ERR, "socket call failed: %m");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(source_port);
+	addr.sin_addr.s_addr = source_ip;
+	if ((q->udp_fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) >= 0 &&
+	    (setsockopt(q->udp_fd, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof(n)) < 0 ||
+#ifdef SO_REUSEPORT
+	     (reuseport && setsockopt(q->udp_fd, SOL_SOCKET, SO_REUSEPORT, (char *) &n, sizeof(n)) < 0) ||
+#endif
+	     bind(q->udp_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+		DEBUG(LOG_ERR, "bind call failed: %m");
+		close(q->udp_fd);
+		q->udp_fd = -1;
+	}
+
+	return q->raw_fd < 0 || q->udp_fd < 0 ? -1 : 0;
+}
+
+
+int tx_queue_mmap(struct tx_queue *q, uint8_t *mac)
+{
+	struct sockaddr_ll sll;
+
+	if ((q->ring_fd = socket(PF_PACKET, SOCK_RAW, 0)) < 0) {
+		DEBUG(LOG_ERR, "socket call failed: %m");
+		return -1;
+	}
+
+	/* protocol 0, nothing is received on it */
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = q->ifindex;
+	if (bind(q->ring_fd, (struct sockaddr *) &sll, sizeof(sll)) < 0 ||
+	    packet_ring_tx(&q->ring, q->ring_fd) < 0) {
+		close(q->ring_fd);
+		q->ring_fd = -1;
+		return -1;
+	}
+
+	memcpy(q->mac, mac, 6);
+	return 0;
+}
+
+
+/* whatever must happen before a reply leaves, the server's journal */
+static void before_send(struct tx_queue *q)
+{
+	if (q->before_send) q->before_send();
+}
+
+
+/* build a raw reply straight into a tx ring frame, -1 if the ring is full */
+static int ring_raw_packet(struct tx_queue *q, struct dhcpMessage *payload,
+			   uint32_t dest_ip, int dest_port, uint8_t *dest_arp)
+{
+	struct ethhdr *eth;
+	uint8_t *frame;
+
+	if (!(frame = packet_ring_frame(&q->ring))) {
+		before_send(q);
+		packet_ring_send(&q->ring);
+		if (!(frame = packet_ring_frame(&q->ring)))
+			return -1;
+	}
+
+	eth = (struct ethhdr *) frame;
+	memcpy(eth->h_dest, dest_arp, ETH_ALEN);
+	memcpy(eth->h_source, q->mac, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+	build_udp_packet((struct udp_dhcp_packet *) (frame + ETH_HLEN), payload,
+			 q->source_ip, q->source_port, dest_ip, dest_port);
+	packet_ring_commit(&q->ring, ETH_HLEN + sizeof(struct udp_dhcp_packet));
+	return 0;
+}
+
+
+/* raw_packet(), sent on the next tx_queue_flush() */
+int queue_raw_packet(struct tx_queue *q, struct dhcpMessage *payload,
+		     uint32_t dest_ip, int dest_port, uint8_t *dest_arp)
+{
+	struct sockaddr_ll *dest;
+
+	if (q->ring.map && ring_raw_packet(q, payload, dest_ip, dest_port, dest_arp) == 0)
+		return 0;
+	if (q->raw_fd < 0) {
+		before_send(q);
+		return raw_packet(payload, q->source_ip, q->source_port,
+				  dest_ip, dest_port, dest_arp, q->ifindex);
+	}
+	if (q->raw_count == TX_BATCH && tx_queue_flush(q) < 0)
+		return -1;
+
+	dest = &q->raw_dest[q->raw_count];
+	memset(dest, 0, sizeof(struct sockaddr_ll));
+	dest->sll_family = AF_PACKET;
+	dest->sll_protocol = htons(ETH_P_IP);
+	dest->sll_ifindex = q->ifindex;
+	dest->sll_halen = 6;
+	memcpy(dest->sll_addr, dest_arp, 6);
+	build_udp_packet(&q->raw[q->raw_count], payload, q->source_ip, q->source_port,
+			 dest_ip, dest_port);
+	q->raw_count++;
+	return 0;
+}
+
+
+/* kernel_packet(), sent on the next tx_queue_flush() */
+int queue_kernel_packet(struct tx_queue *q, struct dhcpMessage *payload,
+			uint32_t dest_ip, int dest_port)
+{
+	struct sockaddr_in *dest;
+
+	if (q->udp_fd < 0) {
+		before_send(q);
+		return kernel_packet(payload, q->source_ip, q->source_port,
+				     dest_ip, dest_port);
+	}
+	if (q->udp_count == TX_BATCH && tx_queue_flush(q) < 0)
+		return -1;
+
+	dest = &q->udp_dest[q->udp_count];
+	memset(dest, 0, sizeof(struct sockaddr_in));
+	dest->sin_family = AF_INET;
+	dest->sin_port = htons(dest_port);
+	dest->sin_addr.s_addr = dest_ip;
+	memcpy(&q->udp[q->udp_count], payload, sizeof(struct dhcpMessage));
+	q->udp_count++;
+	return 0;
+}
+
+
+/* -1 if some were lost. sendmmsg() stops at the first message that
+ * fails, that one is skipped and the rest still go out */
+static int send_batch(int fd, struct mmsghdr *msgs, int count)
+{
+	int sent = 0, n, ret = 0;
+
+	while (sent < count) {
+		if ((n = sendmmsg(fd, msgs + sent, count - sent, 0)) < 0) {
+			if (errno == EINTR) continue;
+			LOG(LOG_ERR, "write on socket failed for reply %d of %d: %m", sent + 1, count);
+			ret = -1;
+			n = 1;
+		}
+		sent += n;
+	}
+	return ret;
+}
+
+
+/* send everything queued, -1 if some of it was lost */
+int tx_queue_flush(struct tx_queue *q)
+{
+	int ret = 0;
+
+	before_send(q);
+	if (q->ring.map && packet_ring_send(&q->ring) < 0)
+		ret = -1;
+	if (q->raw_count && send_batch(q->raw_fd, q->raw_msgs, q->raw_count) < 0)
+		ret = -1;
+	if (q->udp_count && send_batch(q->udp_fd, q->udp_msgs, q->udp_count) < 0)
+		ret = -1;
+	q->raw_count = q->udp_count = 0;
+	return ret;
+}
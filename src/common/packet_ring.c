@@ -0,0 +1,194 @@
+/*
+ * packet_ring.c -- PACKET_RX_RING/PACKET_TX_RING for the raw sockets
+ *
+ * With packet_mmap on, frames go through TPACKET_V3 rings shared with
+ * the kernel instead of a recvfrom()/sendto() each. Received frames
+ * are read in place from the ring blocks; replies are built in place
+ * in tx frames and sent together by one send(). Without the switch, or
+ * on kernels that refuse the ring, the sockets are used as before.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+
+#include "udhcp/packet_ring.h"
+#include "udhcp/common.h"
+
+/* where frame data starts without PACKET_TX_HAS_OFF */
+#define TX_DATA		(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+/* pushed forward so the ip header lands on 16 bytes */
+#define TX_OFFSET	(((TX_DATA + ETH_HLEN + 15) & ~15) - ETH_HLEN)
+
+char packet_mmap;
+
+
+static int ring_map(struct packet_ring *ring, int fd, int which, struct tpacket_req3 *req)
+{
+	int version = TPACKET_V3;
+
+	memset(ring, 0, sizeof(struct packet_ring));
+	ring->fd = fd;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+	    setsockopt(fd, SOL_PACKET, which, req, sizeof(struct tpacket_req3)) < 0) {
+		LOG(LOG_WARNING, "Could not set up a packet ring, %m");
+		return -1;
+	}
+
+	ring->block_size = req->tp_block_size;
+	ring->block_nr = req->tp_block_nr;
+	ring->frame_nr = req->tp_frame_nr;
+	ring->size = (size_t) req->tp_block_size * req->tp_block_nr;
+	ring->map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring->map == MAP_FAILED) {
+		LOG(LOG_WARNING, "Could not map the packet ring, %m");
+		ring->map = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+int packet_ring_rx(struct packet_ring *ring, int fd)
+{
+	struct tpacket_req3 req;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_RX_BLOCK_SIZE;
+	req.tp_block_nr = RING_RX_BLOCKS;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = RING_RX_BLOCK_SIZE / RING_FRAME_SIZE * RING_RX_BLOCKS;
+	req.tp_retire_blk_tov = RING_RX_TIMEOUT;
+	return ring_map(ring, fd, PACKET_RX_RING, &req);
+}
+
+
+int packet_ring_tx(struct packet_ring *ring, int fd)
+{
+	struct tpacket_req3 req;
+	int one = 1;
+
+	/* the frames say where they start, see TX_OFFSET, and a frame the
+	 * kernel rejects is dropped rather than blocking the ring */
+	if (setsockopt(fd, SOL_PACKET, PACKET_TX_HAS_OFF, &one, sizeof(one)) < 0 ||
+	    setsockopt(fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) < 0) {
+		LOG(LOG_WARNING, "Could not set up a packet ring, %m");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = getpagesize();
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = RING_TX_FRAMES;
+	req.tp_block_nr = RING_TX_FRAMES / (req.tp_block_size / RING_FRAME_SIZE);
+	return ring_map(ring, fd, PACKET_TX_RING, &req);
+}
+
+
+void packet_ring_close(struct packet_ring *ring)
+{
+	if (ring->map) munmap(ring->map, ring->size);
+	ring->map = NULL;
+}
+
+
+static struct tpacket_block_desc *rx_block(struct packet_ring *ring)
+{
+	return (struct tpacket_block_desc *) (ring->map + ring->current * ring->block_size);
+}
+
+
+uint8_t *packet_ring_recv(struct packet_ring *ring, int *len)
+{
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *hdr;
+
+	while (!ring->left) {
+		/* the caller is done with the last packet of the block */
+		if (ring->next) {
+			rx_block(ring)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+			__sync_synchronize();
+			ring->current = (ring->current + 1) % ring->block_nr;
+			ring->next = NULL;
+		}
+
+		block = rx_block(ring);
+		if (!(block->hdr.bh1.block_status & TP_STATUS_USER))
+			return NULL;
+		__sync_synchronize();
+		ring->left = block->hdr.bh1.num_pkts;
+		ring->next = (struct tpacket3_hdr *) ((uint8_t *) block +
+						      block->hdr.bh1.offset_to_first_pkt);
+	}
+
+	hdr = ring->next;
+	ring->next = (struct tpacket3_hdr *) ((uint8_t *) hdr + hdr->tp_next_offset);
+	ring->left--;
+
+	ring->status = hdr->tp_status;
+	*len = hdr->tp_snaplen;
+	return (uint8_t *) hdr + hdr->tp_net;
+}
+
+
+int packet_ring_csum_ok(struct packet_ring *ring)
+{
+#ifdef TP_STATUS_CSUM_VALID
+	if (ring->status & TP_STATUS_CSUM_VALID) return 1;
+#endif
+	return (ring->status & TP_STATUS_CSUMNOTREADY) != 0;
+}
+
+
+static struct tpacket3_hdr *tx_frame(struct packet_ring *ring)
+{
+	uint32_t per_block = ring->block_size / RING_FRAME_SIZE;
+
+	return (struct tpacket3_hdr *) (ring->map + (ring->current / per_block) * ring->block_size +
+					(ring->current % per_block) * RING_FRAME_SIZE);
+}
+
+
+uint8_t *packet_ring_frame(struct packet_ring *ring)
+{
+	struct tpacket3_hdr *hdr = tx_frame(ring);
+
+	/* still owned by the kernel */
+	if (hdr->tp_status != TP_STATUS_AVAILABLE)
+		return NULL;
+	return (uint8_t *) hdr + TX_OFFSET;
+}
+
+
+void packet_ring_commit(struct packet_ring *ring, int len)
+{
+	struct tpacket3_hdr *hdr = tx_frame(ring);
+
+	hdr->tp_len = len;
+	hdr->tp_mac = TX_OFFSET;
+	hdr->tp_next_offset = 0;
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+	ring->current = (ring->current + 1) % ring->frame_nr;
+	ring->queued++;
+}
+
+
+int packet_ring_send(struct packet_ring *ring)
+{
+	if (!ring->queued) return 0;
+	ring->queued = 0;
+
+	while (send(ring->fd, NULL, 0, 0) < 0) {
+		if (errno == EINTR) continue;
+		DEBUG(LOG_ERR, "write on socket failed: %m");
+		return -1;
+	}
+	return 0;
+}
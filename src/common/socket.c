@@ -90,7 +90,7 @@ int read_interface(char *interface, int *ifindex, uint32_t *addr, uint8_t *arp)
 }
 
 
-int listen_socket(uint32_t ip, int port, char *inf)
+static int open_listen(uint32_t ip, int port, char *inf, int reuseport)
 {
 	struct ifreq interface;
 	int fd;
@@ -116,6 +116,12 @@ int listen_socket(uint32_t ip, int port, char *inf)
 		close(fd);
 		return -1;
 	}
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &n, sizeof(n)) == -1) {
+		close(fd);
+		return -1;
+	}
+#endif
 
 	strncpy(interface.ifr_ifrn.ifrn_name, inf, IFNAMSIZ);
 	if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,(char *)&interface, sizeof(interface)) < 0) {
@@ -130,3 +136,17 @@ int listen_socket(uint32_t ip, int port, char *inf)
 
 	return fd;
 }
+
+
+int listen_socket(uint32_t ip, int port, char *inf)
+{
+	return open_listen(ip, port, inf, 0);
+}
+
+
+/* one of several sockets bound to the port, as the server workers
+ * each have. Others may only share it with SO_REUSEPORT set as well */
+int listen_socket_shared(uint32_t ip, int port, char *inf)
+{
+	return open_listen(ip, port, inf, 1);
+}
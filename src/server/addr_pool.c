@@ -0,0 +1,134 @@
+/*
+ * addr_pool.c -- bitmaps of the addresses between start and end
+ *
+ * find_address() used to walk the range one address at a time, with a
+ * lease table lookup and a reservedIp() call for each. The bitmaps
+ * let it skip a word of taken addresses at once, and a cursor that
+ * keeps moving forward spreads reuse across the pool.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/addr_pool.h"
+
+#define WORD_BITS	(8 * sizeof(unsigned long))
+
+struct addr_pool addr_pool;
+
+
+static uint32_t pool_size(struct addr_pool *pool)
+{
+	return pool->end - pool->start + 1;
+}
+
+
+static void set_bit(unsigned long *map, uint32_t off, int set)
+{
+	if (set) map[off / WORD_BITS] |= 1UL << (off % WORD_BITS);
+	else map[off / WORD_BITS] &= ~(1UL << (off % WORD_BITS));
+}
+
+
+void addr_pool_init(struct addr_pool *pool, uint32_t start, uint32_t end)
+{
+	struct static_lease *cur;
+	uint32_t words, off, addr;
+	int i;
+
+	for (i = 0; i < ADDR_MAPS; i++) free(pool->map[i]);
+	memset(pool, 0, sizeof(struct addr_pool));
+
+	pool->start = ntohl(start);
+	pool->end = ntohl(end);
+	if (pool->end < pool->start) pool->end = pool->start;
+
+	words = pool_size(pool) / WORD_BITS + 1;
+	for (i = 0; i < ADDR_MAPS; i++)
+		pool->map[i] = xcalloc(words, sizeof(unsigned long));
+
+	/* ie, 192.168.55.0 and 192.168.55.255 are never handed out, and
+	 * neither are the bits past the end of the last word */
+	for (off = 0; off < words * WORD_BITS; off++) {
+		addr = pool->start + off;
+		if (off >= pool_size(pool) || !(addr & 0xFF) || (addr & 0xFF) == 0xFF)
+			set_bit(pool->map[ADDR_RESERVED], off, 1);
+	}
+
+	for (cur = server_config.static_leases; cur; cur = cur->next)
+		addr_pool_mark(pool, ADDR_RESERVED, *cur->ip, 1);
+}
+
+
+void addr_pool_mark(struct addr_pool *pool, int map, uint32_t ip, int set)
+{
+	uint32_t addr = ntohl(ip);
+
+	if (!pool->map[map] || addr < pool->start || addr > pool->end)
+		return;
+	if (map == ADDR_RESERVED && !set && (!(addr & 0xFF) || (addr & 0xFF) == 0xFF))
+		return;
+	set_bit(pool->map[map], addr - pool->start, set);
+}
+
+
+/* first offset at or after off, below limit, whose word in the
+ * combined maps has a zero bit. The maps are inverted for taken */
+static int64_t scan(struct addr_pool *pool, uint32_t off, uint32_t limit, int taken)
+{
+	unsigned long word;
+	uint32_t w;
+
+	for (w = off / WORD_BITS; w * WORD_BITS < limit; w++) {
+		if (taken)
+			word = ~((pool->map[ADDR_USED][w] | pool->map[ADDR_CONFLICT][w]) &
+				 ~pool->map[ADDR_RESERVED][w]);
+		else
+			word = pool->map[ADDR_USED][w] | pool->map[ADDR_RESERVED][w] |
+			       pool->map[ADDR_CONFLICT][w] | pool->map[ADDR_PROBED][w];
+
+		if (w == off / WORD_BITS)
+			word |= (1UL << (off % WORD_BITS)) - 1;
+		if (~word) {
+			off = w * WORD_BITS + __builtin_ctzl(~word);
+			return off < limit ? off : -1;
+		}
+	}
+	return -1;
+}
+
+
+uint32_t addr_pool_next_free(struct addr_pool *pool)
+{
+	int64_t off;
+
+	if (!pool->map[ADDR_USED]) return 0;
+
+	if (pool->cursor >= pool_size(pool)) pool->cursor = 0;
+	if ((off = scan(pool, pool->cursor, pool_size(pool), 0)) < 0 &&
+	    (off = scan(pool, 0, pool->cursor, 0)) < 0)
+		return 0;
+
+	pool->cursor = off + 1;
+	return htonl(pool->start + off);
+}
+
+
+uint32_t addr_pool_next_taken(struct addr_pool *pool, uint32_t ip)
+{
+	uint32_t from = 0;
+	int64_t off;
+
+	if (!pool->map[ADDR_USED]) return 0;
+
+	if (ip) {
+		if (ntohl(ip) >= pool->end) return 0;
+		if (ntohl(ip) >= pool->start) from = ntohl(ip) - pool->start + 1;
+	}
+	if ((off = scan(pool, from, pool_size(pool), 1)) < 0)
+		return 0;
+	return htonl(pool->start + off);
+}
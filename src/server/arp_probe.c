@@ -0,0 +1,257 @@
+/*
+ * arp_probe.c -- ARP conflict probes that don't stop the server
+ *
+ * arpping() opens a socket and waits up to two seconds for every
+ * address find_address() picks, with every other client waiting
+ * behind it. Here the probe is sent on one persistent socket and the
+ * DISCOVER is parked until a reply shows the address is taken (we
+ * pick another one) or the probe times out (we send the OFFER).
+ */
+
+#include <sys/socket.h>
+#include <netinet/if_ether.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/arpping.h"
+#include "udhcp/common.h"
+#include "udhcp/serverpacket.h"
+#include "udhcp/addr_pool.h"
+#include "udhcp/arp_probe.h"
+#include "udhcp/preprobe.h"
+#include "udhcp/lease_shard.h"
+#include "udhcp/worker.h"
+
+struct arp_pending {
+	int used;
+	time_t deadline;
+	uint32_t yiaddr;
+	struct dhcpMessage packet;	/* the DISCOVER, request points here */
+	struct dhcp_request request;
+};
+
+static int arp_fd = -1;
+static uint32_t our_ip;
+static uint8_t our_mac[6];
+static char *our_interface;
+/* a finished probe, copied off the table */
+struct arp_done {
+	struct dhcpMessage packet;
+	struct dhcp_request request;
+};
+
+static struct arp_pending pending[ARP_PROBE_MAX];
+static int pending_count;
+
+
+int arp_probe_init(uint32_t ip, uint8_t *mac, char *interface)
+{
+	int optval = 1;
+
+	our_ip = ip;
+	memcpy(our_mac, mac, 6);
+	our_interface = interface;
+
+	if (arp_fd >= 0) return 0;
+
+	if ((arp_fd = socket(PF_PACKET, SOCK_PACKET, htons(ETH_P_ARP))) == -1) {
+		LOG(LOG_ERR, "Could not open raw socket for ARP probes, probing will block");
+		return -1;
+	}
+
+	if (setsockopt(arp_fd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) == -1 ||
+	    fcntl(arp_fd, F_SETFL, fcntl(arp_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		LOG(LOG_ERR, "Could not set up the ARP probe socket, probing will block");
+		close(arp_fd);
+		arp_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+int arp_probe_fd(void)
+{
+	return arp_fd;
+}
+
+
+int arp_probe_room(void)
+{
+	return arp_fd >= 0 && pending_count < ARP_PROBE_MAX;
+}
+
+
+int arp_probe_pending(uint8_t *chaddr)
+{
+	int i;
+
+	for (i = 0; pending_count && i < ARP_PROBE_MAX; i++)
+		if (pending[i].used && !memcmp(pending[i].packet.chaddr, chaddr, 16))
+			return 1;
+	return 0;
+}
+
+
+int arp_probe_send(uint32_t yiaddr)
+{
+	struct sockaddr addr;
+	struct arpMsg arp;
+
+	memset(&arp, 0, sizeof(arp));
+	memcpy(arp.h_dest, MAC_BCAST_ADDR, 6);		/* MAC DA */
+	memcpy(arp.h_source, our_mac, 6);		/* MAC SA */
+	arp.h_proto = htons(ETH_P_ARP);			/* protocol type (Ethernet) */
+	arp.htype = htons(ARPHRD_ETHER);		/* hardware type */
+	arp.ptype = htons(ETH_P_IP);			/* protocol type (ARP message) */
+	arp.hlen = 6;					/* hardware address length */
+	arp.plen = 4;					/* protocol address length */
+	arp.operation = htons(ARPOP_REQUEST);		/* ARP op code */
+	memcpy(arp.sInaddr, &our_ip, sizeof(our_ip));	/* source IP address */
+	memcpy(arp.sHaddr, our_mac, 6);			/* source hardware address */
+	memcpy(arp.tInaddr, &yiaddr, sizeof(yiaddr));	/* target IP address */
+
+	memset(&addr, 0, sizeof(addr));
+	strncpy(addr.sa_data, our_interface, sizeof(addr.sa_data) - 1);
+	return sendto(arp_fd, &arp, sizeof(arp), 0, &addr, sizeof(addr));
+}
+
+
+int arp_probe_start(struct dhcp_request *request, uint32_t yiaddr)
+{
+	struct arp_pending *p;
+	struct in_addr temp;
+	int i;
+
+	if (!arp_probe_room()) return -1;
+
+	for (i = 0; pending[i].used; i++);
+	p = &pending[i];
+
+	if (arp_probe_send(yiaddr) < 0) {
+		/* the caller sends the OFFER unprobed */
+		temp.s_addr = yiaddr;
+		LOG(LOG_ERR, "Could not send ARP probe for %s, offering it unprobed: %m",
+		    inet_ntoa(temp));
+		return -1;
+	}
+
+	p->used = 1;
+	p->deadline = time(0) + ARP_PROBE_TIMEOUT;
+	p->yiaddr = yiaddr;
+	memcpy(&p->packet, request->packet, sizeof(struct dhcpMessage));
+	memcpy(&p->request, request, sizeof(struct dhcp_request));
+	p->request.packet = &p->packet;
+	pending_count++;
+	return 0;
+}
+
+
+/* take a probe off the table, its OFFER is replayed by replay() */
+static void finish(struct arp_pending *p, int probed, struct arp_done *done)
+{
+	memcpy(&done->packet, &p->packet, sizeof(struct dhcpMessage));
+	memcpy(&done->request, &p->request, sizeof(struct dhcp_request));
+	done->request.probed = probed;
+	p->used = 0;
+	pending_count--;
+}
+
+
+/* send the OFFERs of finished probes again, once the table isn't
+ * walked anymore. Replayed after a timeout one finds the lease it
+ * reserved, after a conflict it picks a new address */
+static void replay(struct arp_done *done, int count)
+{
+	struct lease_shard *shard;
+	int i;
+
+	if (!count) return;
+
+	/* the client's shard is locked before server_lock */
+	pthread_mutex_unlock(&server_lock);
+	for (i = 0; i < count; i++) {
+		done[i].request.packet = &done[i].packet;
+		shard = lease_shard(done[i].packet.chaddr);
+		pthread_mutex_lock(&shard->lock);
+		if (sendOffer(&done[i].request) < 0)
+			LOG(LOG_ERR, "send OFFER failed");
+		pthread_mutex_unlock(&shard->lock);
+	}
+	pthread_mutex_lock(&server_lock);
+}
+
+
+void arp_probe_conflict(uint32_t yiaddr)
+{
+	struct in_addr temp;
+
+	temp.s_addr = yiaddr;
+	LOG(LOG_INFO, "%s belongs to someone, reserving it for %ld seconds",
+		inet_ntoa(temp), server_config.conflict_time);
+	addr_pool_mark(&addr_pool, ADDR_CONFLICT, yiaddr, 1);
+	lease_reserve(yiaddr, server_config.conflict_time);
+}
+
+
+void arp_probe_read(void)
+{
+	struct arp_done done[ARP_PROBE_MAX];
+	struct arpMsg arp;
+	uint32_t yiaddr;
+	int i, count = 0;
+
+	if (arp_fd < 0) return;
+
+	while (recv(arp_fd, &arp, sizeof(arp), 0) >= 0) {
+		if (arp.operation != htons(ARPOP_REPLY) || memcmp(arp.tHaddr, our_mac, 6))
+			continue;
+		memcpy(&yiaddr, arp.sInaddr, 4);
+
+		if (preprobe_reply(yiaddr))
+			continue;
+
+		for (i = 0; i < ARP_PROBE_MAX; i++) {
+			if (!pending[i].used || pending[i].yiaddr != yiaddr)
+				continue;
+			arp_probe_conflict(yiaddr);
+			finish(&pending[i], 0, &done[count++]);
+		}
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		DEBUG(LOG_ERR, "Error reading ARP replies: %m");
+	replay(done, count);
+}
+
+
+void arp_probe_expire(void)
+{
+	struct arp_done done[ARP_PROBE_MAX];
+	time_t now = time(0);
+	int i, count = 0;
+
+	for (i = 0; pending_count && i < ARP_PROBE_MAX; i++)
+		if (pending[i].used && pending[i].deadline <= now) {
+			DEBUG(LOG_INFO, "No valid arp replies for this address");
+			finish(&pending[i], 1, &done[count++]);
+		}
+	replay(done, count);
+}
+
+
+time_t arp_probe_deadline(void)
+{
+	time_t deadline = 0;
+	int i;
+
+	for (i = 0; pending_count && i < ARP_PROBE_MAX; i++)
+		if (pending[i].used && (!deadline || pending[i].deadline < deadline))
+			deadline = pending[i].deadline;
+	return deadline;
+}
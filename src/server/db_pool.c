@@ -0,0 +1,143 @@
+/*
+ * db_pool.c -- long lived MySQL connections for DHCPsql
+ *
+ * Every lookup used to pay for mysql_init + mysql_real_connect +
+ * mysql_close. The pool keeps a few connections open, pings them
+ * when they have been idle for a while and transparently reopens
+ * the ones the server dropped.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <mysql.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/db_pool.h"
+
+struct db_pool_t db_pool;
+
+/* workers pick their slots under this, see worker.c */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void db_conn_close(struct db_conn *conn)
+{
+	int i;
+
+	/* statements die with their connection */
+	for (i = 0; i < DB_STMT_MAX; i++) {
+		if (conn->stmt[i]) mysql_stmt_close(conn->stmt[i]);
+		conn->stmt[i] = NULL;
+	}
+	if (conn->mysql) mysql_close(conn->mysql);
+	conn->mysql = NULL;
+}
+
+
+static int db_conn_open(struct db_conn *conn)
+{
+	unsigned int timeout = db_pool.connect_timeout;
+
+	if (!(conn->mysql = mysql_init(NULL))) {
+		LOG(LOG_ERR, "mysql_init failed, out of memory?");
+		return -1;
+	}
+
+	if (timeout)
+		mysql_options(conn->mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+
+	if (!mysql_real_connect(conn->mysql, server_config.dbserver, server_config.user,
+				server_config.password, server_config.database, 0, NULL, 0)) {
+		LOG(LOG_ERR, "Unable to connect to MySQL on %s: %s",
+			server_config.dbserver, mysql_error(conn->mysql));
+		db_conn_close(conn);
+		return -1;
+	}
+
+	DEBUG(LOG_INFO, "Opened MySQL connection to %s", server_config.dbserver);
+	conn->last_used = time(0);
+	return 0;
+}
+
+
+int db_pool_init(void)
+{
+	if (db_pool.conns) return 0;
+
+	if (!db_pool.size) db_pool.size = 1;
+	db_pool.conns = xcalloc(db_pool.size, sizeof(struct db_conn));
+
+	return db_conn_open(&db_pool.conns[0]);
+}
+
+
+struct db_conn *db_conn_get(void)
+{
+	struct db_conn *conn = NULL;
+	unsigned int i;
+
+	if (!db_pool.conns) db_pool_init();
+
+	/* prefer a slot that is already connected */
+	pthread_mutex_lock(&pool_lock);
+	for (i = 0; i < db_pool.size; i++) {
+		if (db_pool.conns[i].busy) continue;
+		if (db_pool.conns[i].mysql) {
+			conn = &db_pool.conns[i];
+			break;
+		}
+		if (!conn) conn = &db_pool.conns[i];
+	}
+	if (conn) conn->busy = 1;
+	pthread_mutex_unlock(&pool_lock);
+
+	if (!conn) {
+		LOG(LOG_ERR, "All %u MySQL connections are in use", db_pool.size);
+		return NULL;
+	}
+
+	/* health check connections that sat idle, the server may have timed them out */
+	if (conn->mysql && db_pool.ping_interval &&
+	    time(0) - conn->last_used >= (time_t) db_pool.ping_interval &&
+	    mysql_ping(conn->mysql)) {
+		LOG(LOG_WARNING, "MySQL connection went away (%s), reconnecting",
+			mysql_error(conn->mysql));
+		db_conn_close(conn);
+	}
+
+	if (!conn->mysql && db_conn_open(conn) < 0) {
+		conn->busy = 0;
+		return NULL;
+	}
+
+	return conn;
+}
+
+
+void db_conn_put(struct db_conn *conn, int failed)
+{
+	if (!conn) return;
+
+	if (failed) db_conn_close(conn);
+	else conn->last_used = time(0);
+
+	pthread_mutex_lock(&pool_lock);
+	conn->busy = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+
+void db_pool_close(void)
+{
+	unsigned int i;
+
+	if (!db_pool.conns) return;
+
+	for (i = 0; i < db_pool.size; i++)
+		db_conn_close(&db_pool.conns[i]);
+	free(db_pool.conns);
+	db_pool.conns = NULL;
+}
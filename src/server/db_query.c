@@ -0,0 +1,473 @@
+/*
+ * db_query.c -- prepared statements for the DHCPsql lookups
+ *
+ * The SQL text only depends on the table names and table_efficient,
+ * so every statement is prepared once per pooled connection and the
+ * MAC/IP are bound as parameters. Efficient tables store the mac and
+ * ip as numbers, readable tables as "001122334455" and "192.168.0.1".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+#include <mysql.h>
+#include <errmsg.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/options.h"
+#include "udhcp/common.h"
+#include "udhcp/db_pool.h"
+#include "udhcp/db_query.h"
+
+/* a mac in the form the table stores it */
+struct db_mac {
+	unsigned long long number;
+	char text[13];
+	unsigned long text_len;
+};
+
+
+/* build the SQL for a statement, allocated so long table names are never cut */
+static char *db_stmt_sql(int id)
+{
+	const char *sl = server_config.table_staticleases;
+	const char *opt = server_config.table_options;
+	const char *fmt = NULL;
+	char *sql;
+	int len;
+
+	switch (id) {
+	case DB_IP_BY_MAC:
+		fmt = server_config.table_efficient ?
+			"SELECT ip, class FROM %s WHERE mac = ?" :
+			"SELECT INET_ATON(ip), class FROM %s WHERE LOWER(mac) = ?";
+		break;
+	case DB_IP_RESERVED:
+		fmt = server_config.table_efficient ?
+			"SELECT TRUE FROM %s WHERE ip = ? LIMIT 1" :
+			"SELECT TRUE FROM %s WHERE ip = INET_NTOA(?) LIMIT 1";
+		break;
+	case DB_ADD_STATIC:
+		fmt = server_config.table_efficient ?
+			"INSERT INTO %s (mac, ip) VALUES (?, ?)" :
+			"INSERT INTO %s (mac, ip) VALUES (?, INET_NTOA(?))";
+		break;
+	case DB_OPTIONS_BY_CLASS:
+		sl = opt;	/* only needs the options table */
+		fmt = "SELECT * FROM (SELECT code, data FROM %s WHERE class = ? "
+			"UNION SELECT code, data FROM %s WHERE class = 0) AS x ORDER BY code";
+		break;
+	case DB_STATIC_FINGERPRINT:
+		fmt = "SELECT COUNT(*), BIT_XOR(CRC32(CONCAT_WS(',', mac, ip, IFNULL(class, '')))) FROM %s";
+		break;
+	case DB_ALL_STATIC:
+		fmt = server_config.table_efficient ?
+			"SELECT mac, ip, class FROM %s" :
+			"SELECT CAST(CONV(mac, 16, 10) AS UNSIGNED), INET_ATON(ip), class FROM %s";
+		break;
+	case DB_OPTIONS_FINGERPRINT:
+		sl = opt;	/* only needs the options table */
+		fmt = "SELECT COUNT(*), BIT_XOR(CRC32(CONCAT_WS(',', class, code, data))) FROM %s";
+		break;
+	case DB_ALL_OPTIONS:
+		sl = opt;
+		fmt = "SELECT class, code, data FROM %s ORDER BY code";
+		break;
+	default:
+		return NULL;
+	}
+
+	len = snprintf(NULL, 0, fmt, sl, opt) + 1;
+	sql = xmalloc(len);
+	snprintf(sql, len, fmt, sl, opt);
+	return sql;
+}
+
+
+/* get the prepared statement id on conn, preparing it on first use */
+static MYSQL_STMT *db_stmt(struct db_conn *conn, int id)
+{
+	MYSQL_STMT *stmt;
+	char *sql;
+
+	if (conn->stmt[id]) return conn->stmt[id];
+
+	if (!(stmt = mysql_stmt_init(conn->mysql))) {
+		LOG(LOG_ERR, "mysql_stmt_init failed: %s", mysql_error(conn->mysql));
+		return NULL;
+	}
+
+	sql = db_stmt_sql(id);
+	DEBUG(LOG_INFO, "preparing %s", sql);
+	if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
+		LOG(LOG_ERR, "Unable to prepare '%s': %s", sql, mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		free(sql);
+		return NULL;
+	}
+	free(sql);
+
+	conn->stmt[id] = stmt;
+	return stmt;
+}
+
+
+/* run statement id and buffer its result. Retries once on a fresh
+ * connection if MySQL went away. On success the caller fetches the
+ * rows and hands the connection back with db_finish() */
+static MYSQL_STMT *db_execute(struct db_conn **connp, int id, MYSQL_BIND *params, MYSQL_BIND *results)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	unsigned int err;
+	int tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		if (!(conn = db_conn_get()))
+			return NULL;
+
+		if (!(stmt = db_stmt(conn, id))) {
+			err = mysql_errno(conn->mysql);
+		} else if ((params && mysql_stmt_bind_param(stmt, params)) ||
+			   mysql_stmt_execute(stmt) ||
+			   (results && mysql_stmt_bind_result(stmt, results)) ||
+			   mysql_stmt_store_result(stmt)) {
+			err = mysql_stmt_errno(stmt);
+			LOG(LOG_ERR, "%s", mysql_stmt_error(stmt));
+		} else {
+			*connp = conn;
+			return stmt;
+		}
+
+		/* anything but a lost connection is not going to get better */
+		if (err != CR_SERVER_GONE_ERROR && err != CR_SERVER_LOST) {
+			db_conn_put(conn, 0);
+			return NULL;
+		}
+		db_conn_put(conn, 1);
+	}
+	return NULL;
+}
+
+
+/* next row, a cut off string still counts as a row */
+static int db_fetch(MYSQL_STMT *stmt)
+{
+	int ret = mysql_stmt_fetch(stmt);
+
+	return ret == 0 || ret == MYSQL_DATA_TRUNCATED;
+}
+
+
+static void db_finish(struct db_conn *conn, MYSQL_STMT *stmt)
+{
+	mysql_stmt_free_result(stmt);
+	db_conn_put(conn, 0);
+}
+
+
+static void db_bind_mac(MYSQL_BIND *bind, struct db_mac *m, uint8_t *mac)
+{
+	int i;
+
+	m->number = 0;
+	for (i = 0; i < 6; i++)
+		m->number = (m->number << 8) | mac[i];
+	snprintf(m->text, sizeof(m->text), "%02x%02x%02x%02x%02x%02x",
+		 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	m->text_len = 12;
+
+	memset(bind, 0, sizeof(MYSQL_BIND));
+	if (server_config.table_efficient) {
+		bind->buffer_type = MYSQL_TYPE_LONGLONG;
+		bind->buffer = &m->number;
+		bind->is_unsigned = 1;
+	} else {
+		bind->buffer_type = MYSQL_TYPE_STRING;
+		bind->buffer = m->text;
+		bind->buffer_length = sizeof(m->text);
+		bind->length = &m->text_len;
+	}
+}
+
+
+/* ips are stored host order, the way INET_ATON() returns them */
+static void db_bind_ip(MYSQL_BIND *bind, unsigned long long *value, uint32_t ip)
+{
+	*value = ntohl(ip);
+
+	memset(bind, 0, sizeof(MYSQL_BIND));
+	bind->buffer_type = MYSQL_TYPE_LONGLONG;
+	bind->buffer = value;
+	bind->is_unsigned = 1;
+}
+
+
+int db_ip_by_mac(uint8_t *mac, uint32_t *ip, int32_t *class)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND param, result[2];
+	struct db_mac m;
+	unsigned long long ip_value = 0;
+	int32_t class_value = 0;
+	bool ip_null = 0, class_null = 0;
+	int found = 0;
+
+	db_bind_mac(&param, &m, mac);
+
+	memset(result, 0, sizeof(result));
+	result[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	result[0].buffer = &ip_value;
+	result[0].is_unsigned = 1;
+	result[0].is_null = &ip_null;
+	result[1].buffer_type = MYSQL_TYPE_LONG;
+	result[1].buffer = &class_value;
+	result[1].is_null = &class_null;
+
+	if (!(stmt = db_execute(&conn, DB_IP_BY_MAC, &param, result)))
+		return -1;
+
+	/* Should be only one row, otherwise take the last I guess ;) */
+	while (db_fetch(stmt)) {
+		if (ip_null) continue;
+		*ip = htonl((uint32_t) ip_value);
+		if (class) *class = class_null ? -1 : class_value;
+		found = 1;
+	}
+
+	db_finish(conn, stmt);
+	return found;
+}
+
+
+int db_ip_reserved(uint32_t ip)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND param;
+	unsigned long long ip_value;
+	int found;
+
+	db_bind_ip(&param, &ip_value, ip);
+
+	if (!(stmt = db_execute(&conn, DB_IP_RESERVED, &param, NULL)))
+		return -1;
+
+	found = mysql_stmt_num_rows(stmt) > 0;
+
+	db_finish(conn, stmt);
+	return found;
+}
+
+
+int db_add_static_lease(uint8_t *mac, uint32_t ip)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND params[2];
+	struct db_mac m;
+	unsigned long long ip_value;
+
+	db_bind_mac(&params[0], &m, mac);
+	db_bind_ip(&params[1], &ip_value, ip);
+
+	if (!(stmt = db_execute(&conn, DB_ADD_STATIC, params, NULL)))
+		return 0;
+
+	db_finish(conn, stmt);
+	return 1;
+}
+
+
+int db_add_class_options(uint8_t *optionptr, int32_t class)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND param, result[2];
+	int32_t code;
+	char code_text[4];
+	char data[256];
+	unsigned long data_len;
+	bool code_null = 0, data_null = 0;
+	char *row[2];
+	int added = 0;
+
+	/* a lease without a class only gets the defaults */
+	if (class < 0) class = 0;
+	memset(&param, 0, sizeof(param));
+	param.buffer_type = MYSQL_TYPE_LONG;
+	param.buffer = &class;
+
+	memset(result, 0, sizeof(result));
+	result[0].buffer_type = MYSQL_TYPE_LONG;
+	result[0].buffer = &code;
+	result[0].is_null = &code_null;
+	result[1].buffer_type = MYSQL_TYPE_STRING;
+	result[1].buffer = data;
+	result[1].buffer_length = sizeof(data) - 1;
+	result[1].length = &data_len;
+	result[1].is_null = &data_null;
+
+	if (!(stmt = db_execute(&conn, DB_OPTIONS_BY_CLASS, &param, result)))
+		return -1;
+
+	row[0] = code_text;
+	row[1] = data;
+	while (db_fetch(stmt)) {
+		if (code_null || data_null) continue;
+		snprintf(code_text, sizeof(code_text), "%u", (unsigned) code & 0xff);
+		data[data_len < sizeof(data) ? data_len : sizeof(data) - 1] = '\0';
+		add_option_row(optionptr, row);
+		added++;
+	}
+
+	db_finish(conn, stmt);
+	return added;
+}
+
+
+int db_static_fingerprint(uint32_t *rows, uint32_t *sum)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND result[2];
+	unsigned long long count = 0, crc = 0;
+	bool crc_null = 0;
+
+	memset(result, 0, sizeof(result));
+	result[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	result[0].buffer = &count;
+	result[0].is_unsigned = 1;
+	result[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	result[1].buffer = &crc;
+	result[1].is_unsigned = 1;
+	result[1].is_null = &crc_null;
+
+	if (!(stmt = db_execute(&conn, DB_STATIC_FINGERPRINT, NULL, result)))
+		return -1;
+
+	if (!db_fetch(stmt)) {
+		db_finish(conn, stmt);
+		return -1;
+	}
+	*rows = count;
+	*sum = crc_null ? 0 : crc;
+
+	db_finish(conn, stmt);
+	return 0;
+}
+
+
+int db_foreach_static_lease(void (*fn)(uint8_t *mac, uint32_t ip, int32_t class, void *arg), void *arg)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND result[3];
+	unsigned long long mac_value = 0, ip_value = 0;
+	int32_t class_value = 0;
+	bool mac_null = 0, ip_null = 0, class_null = 0;
+	uint8_t mac[16];
+	int i, rows = 0;
+
+	memset(result, 0, sizeof(result));
+	result[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	result[0].buffer = &mac_value;
+	result[0].is_unsigned = 1;
+	result[0].is_null = &mac_null;
+	result[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	result[1].buffer = &ip_value;
+	result[1].is_unsigned = 1;
+	result[1].is_null = &ip_null;
+	result[2].buffer_type = MYSQL_TYPE_LONG;
+	result[2].buffer = &class_value;
+	result[2].is_null = &class_null;
+
+	if (!(stmt = db_execute(&conn, DB_ALL_STATIC, NULL, result)))
+		return -1;
+
+	memset(mac, 0, sizeof(mac));
+	while (db_fetch(stmt)) {
+		if (mac_null || ip_null) continue;
+		for (i = 0; i < 6; i++)
+			mac[i] = mac_value >> (8 * (5 - i));
+		fn(mac, htonl((uint32_t) ip_value), class_null ? -1 : class_value, arg);
+		rows++;
+	}
+
+	db_finish(conn, stmt);
+	return rows;
+}
+
+
+int db_options_fingerprint(uint32_t *rows, uint32_t *sum)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND result[2];
+	unsigned long long count = 0, crc = 0;
+	bool crc_null = 0;
+
+	memset(result, 0, sizeof(result));
+	result[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	result[0].buffer = &count;
+	result[0].is_unsigned = 1;
+	result[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	result[1].buffer = &crc;
+	result[1].is_unsigned = 1;
+	result[1].is_null = &crc_null;
+
+	if (!(stmt = db_execute(&conn, DB_OPTIONS_FINGERPRINT, NULL, result)))
+		return -1;
+
+	if (!db_fetch(stmt)) {
+		db_finish(conn, stmt);
+		return -1;
+	}
+	*rows = count;
+	*sum = crc_null ? 0 : crc;
+
+	db_finish(conn, stmt);
+	return 0;
+}
+
+
+int db_foreach_option(void (*fn)(int32_t class, uint8_t code, char *data, void *arg), void *arg)
+{
+	struct db_conn *conn;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND result[3];
+	int32_t class, code;
+	char data[256];
+	unsigned long data_len;
+	bool class_null = 0, code_null = 0, data_null = 0;
+	int rows = 0;
+
+	memset(result, 0, sizeof(result));
+	result[0].buffer_type = MYSQL_TYPE_LONG;
+	result[0].buffer = &class;
+	result[0].is_null = &class_null;
+	result[1].buffer_type = MYSQL_TYPE_LONG;
+	result[1].buffer = &code;
+	result[1].is_null = &code_null;
+	result[2].buffer_type = MYSQL_TYPE_STRING;
+	result[2].buffer = data;
+	result[2].buffer_length = sizeof(data) - 1;
+	result[2].length = &data_len;
+	result[2].is_null = &data_null;
+
+	if (!(stmt = db_execute(&conn, DB_ALL_OPTIONS, NULL, result)))
+		return -1;
+
+	while (db_fetch(stmt)) {
+		if (class_null || code_null || data_null) continue;
+		data[data_len < sizeof(data) ? data_len : sizeof(data) - 1] = '\0';
+		fn(class, code & 0xff, data, arg);
+		rows++;
+	}
+
+	db_finish(conn, stmt);
+	return rows;
+}
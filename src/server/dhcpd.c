@@ -46,12 +46,29 @@
 #include "udhcp/common.h"
 #include "udhcp/signalpipe.h"
 #include "udhcp/static_leases.h"
+#include "udhcp/request.h"
+#include "udhcp/lease_shard.h"
+#include "udhcp/addr_pool.h"
+#include "udhcp/arp_probe.h"
+#include "udhcp/preprobe.h"
+#include "udhcp/event.h"
+#include "udhcp/packet_batch.h"
+#include "udhcp/worker.h"
+#include "udhcp/reply_template.h"
+#include "udhcp/journal.h"
+#include "udhcp/notify.h"
 #include "udhcp/version.h"
+#ifdef DHCPsql
+#include "udhcp/db_pool.h"
+#include "udhcp/static_cache.h"
+#include "udhcp/option_cache.h"
+#endif
 
 
 /* globals */
 struct dhcpOfferedAddr *leases;
 struct server_config_t server_config;
+__thread struct tx_queue *tx_queue;
 
 #ifndef COMBINED_BINARY
 static void __attribute__ ((noreturn)) show_usage(void)
@@ -106,27 +123,314 @@ static void __attribute__ ((noreturn)) show_version(void)
 #endif
 
 
-#ifdef COMBINED_BINARY
-int udhcpd_main(int argc, char *argv[])
-#else
-int main(int argc, char *argv[])
+static struct event_loop loop;
+static int probe_timer, autosave_timer;
+#ifdef DHCPsql
+static int refresh_timer, options_timer;
 #endif
+static time_t probe_when;
+static int exit_code;
+
+
+/* run a timer every interval seconds from now on, 0 stops it */
+static void timer_every(int fd, unsigned long interval)
+{
+	event_timer_set(fd, interval ? time(0) + interval : 0, interval);
+}
+
+
+/* finish and start ARP probes, and wake up again when they need it */
+static void probes_run(void)
+{
+	time_t next, when;
+
+	arp_probe_expire();
+	preprobe_run();
+
+	next = arp_probe_deadline();
+	if ((when = preprobe_deadline()) && (!next || when < next))
+		next = when;
+	if (next != probe_when) {
+		event_timer_set(probe_timer, next, 0);
+		probe_when = next;
+	}
+}
+
+
+static void probe_timeout(int fd, void *arg)
+{
+	pthread_mutex_lock(&server_lock);
+	probe_when = 0;
+	probes_run();
+	pthread_mutex_unlock(&server_lock);
+	journal_commit();
+	tx_queue_flush(tx_queue);
+}
+
+
+/* OFFERs whose ARP probe got an answer */
+static void arp_readable(int fd, void *arg)
+{
+	pthread_mutex_lock(&server_lock);
+	arp_probe_read();
+	probes_run();
+	pthread_mutex_unlock(&server_lock);
+	journal_commit();
+	tx_queue_flush(tx_queue);
+}
+
+
+static void autosave(int fd, void *arg)
+{
+	write_leases();
+}
+
+
+/* the journal outgrew journal_size, fold it in early */
+static void journal_full(int fd, void *arg)
+{
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) != sizeof(n))
+		return;
+	autosave(fd, arg);
+	timer_every(autosave_timer, server_config.auto_time);
+}
+
+
+#ifdef DHCPsql
+static void static_refresh(int fd, void *arg)
+{
+	pthread_mutex_lock(&server_lock);
+	static_cache_refresh(0);
+	pthread_mutex_unlock(&server_lock);
+}
+
+
+static void options_refresh(int fd, void *arg)
+{
+	option_cache_refresh(0);
+}
+#endif
+
+
+static void signal_readable(int fd, void *arg)
 {
 	fd_set rfds;
-	struct timeval tv;
-	int server_socket = -1;
-	int bytes, retval;
-	struct dhcpMessage packet;
+
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	switch (udhcp_sp_read(&rfds)) {
+	case SIGUSR1:
+		LOG(LOG_INFO, "Received a SIGUSR1");
+		autosave(fd, arg);
+		/* why not just reset the timeout, eh */
+		timer_every(autosave_timer, server_config.auto_time);
+		break;
+#ifdef DHCPsql
+	case SIGUSR2:
+		LOG(LOG_INFO, "Received a SIGUSR2, reloading static leases and options");
+		pthread_mutex_lock(&server_lock);
+		static_cache_refresh(1);
+		pthread_mutex_unlock(&server_lock);
+		option_cache_refresh(1);
+		timer_every(refresh_timer, static_cache.refresh);
+		timer_every(options_timer, option_cache.refresh);
+		break;
+#endif
+	case SIGTERM:
+		LOG(LOG_INFO, "Received a SIGTERM");
+		workers_stop();
+#ifdef DHCPsql
+		db_pool_close();
+#endif
+		event_loop_stop(&loop);
+		break;
+	}
+}
+
+
+static void handle_packet(struct dhcpMessage *packet, struct option_index *idx)
+{
 	uint8_t *state;
 	uint8_t *server_id, *requested;
 	uint32_t server_id_align, requested_align;
-	unsigned long timeout_end;
-	struct option_set *option;
 	struct dhcpOfferedAddr *lease;
 	struct dhcpOfferedAddr static_lease;
-	int max_sock;
+	struct dhcp_request request;
+	struct lease_shard *shard;
+	int taken;
+
+	if ((state = option_index_get(idx, packet, DHCP_MESSAGE_TYPE)) == NULL) {
+		DEBUG(LOG_ERR, "couldn't get option from packet, ignoring");
+		return;
+	}
+
+	/* Look for a static lease, once for the whole packet */
+	request_init(&request, packet, idx);
+
+	/* the client's leases can't change under us, server_lock is only
+	 * taken for the moments the address pool is needed */
+	shard = lease_shard(packet->chaddr);
+	pthread_mutex_lock(&shard->lock);
+	if(request.static_ip)
+	{
+		printf("Found static lease: %x\n", request.static_ip);
+
+		memcpy(&static_lease.chaddr, packet->chaddr, 16);
+		static_lease.yiaddr = request.static_ip;
+		static_lease.expires = 0;
+
+		lease = &static_lease;
+
+	}
+	else
+	{
+	pthread_mutex_lock(&server_lock);
+	lease = find_lease_by_chaddr(packet->chaddr);
+	pthread_mutex_unlock(&server_lock);
+	}
+
+	switch (state[0]) {
+	case DHCPDISCOVER:
+		DEBUG(LOG_INFO,"received DISCOVER");
+
+		if (sendOffer(&request) < 0) {
+			LOG(LOG_ERR, "send OFFER failed");
+		}
+		break;
+ 		case DHCPREQUEST:
+		DEBUG(LOG_INFO, "received REQUEST");
+
+		requested = request_option(&request, DHCP_REQUESTED_IP);
+		server_id = request_option(&request, DHCP_SERVER_ID);
+
+		if (requested) memcpy(&requested_align, requested, 4);
+		if (server_id) memcpy(&server_id_align, server_id, 4);
+
+		if (lease) {
+			if (server_id) {
+				/* SELECTING State */
+				DEBUG(LOG_INFO, "server_id = %08x", ntohl(server_id_align));
+				if (server_id_align == server_config.server && requested &&
+				    requested_align == lease->yiaddr) {
+					sendACK(&request, lease->yiaddr);
+				}
+			} else {
+				if (requested) {
+					/* INIT-REBOOT State */
+					if (lease->yiaddr == requested_align)
+						sendACK(&request, lease->yiaddr);
+					else sendNAK(packet);
+				} else {
+					/* RENEWING or REBINDING State */
+					if (lease->yiaddr == packet->ciaddr)
+						sendACK(&request, lease->yiaddr);
+					else {
+						/* don't know what to do!!!! */
+						sendNAK(packet);
+					}
+				}
+			}
+
+		/* what to do if we have no record of the client */
+		} else if (server_id) {
+			/* SELECTING State */
+
+		} else if (requested) {
+			/* INIT-REBOOT State */
+			pthread_mutex_lock(&server_lock);
+			if ((lease = find_lease_by_yiaddr(requested_align)) && lease_expired(lease))
+				/* probably best if we drop this lease */
+				lease_forget(lease);
+			taken = lease_taken(requested_align);
+			pthread_mutex_unlock(&server_lock);
+
+			/* make some contention for this address */
+			if (taken) sendNAK(packet);
+			else if (!lease && (requested_align < server_config.start ||
+					    requested_align > server_config.end)) {
+				sendNAK(packet);
+			} /* else remain silent */
+
+		} else {
+			 /* RENEWING or REBINDING State */
+		}
+		break;
+	case DHCPDECLINE:
+		DEBUG(LOG_INFO,"received DECLINE");
+		if (lease) {
+			pthread_mutex_lock(&server_lock);
+			lease_decline(lease, server_config.decline_time);
+			pthread_mutex_unlock(&server_lock);
+		}
+		break;
+	case DHCPRELEASE:
+		DEBUG(LOG_INFO,"received RELEASE");
+		if (lease) {
+			pthread_mutex_lock(&server_lock);
+			lease_set_expires(lease, time(0));
+			pthread_mutex_unlock(&server_lock);
+		}
+		break;
+	case DHCPINFORM:
+		DEBUG(LOG_INFO,"received INFORM");
+		send_inform(&request);
+		break;
+	default:
+		LOG(LOG_WARNING, "unsupported DHCP message (%02x) -- ignoring", state[0]);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+
+static void server_readable(int fd, void *arg)
+{
+	struct worker *w = arg;
+	int n, i;
+
+	if ((n = get_packets(&w->rx, fd)) < 0) {
+		if (errno != EINTR && fd == w->socket) {
+			DEBUG(LOG_INFO, "error on read, %m, reopening socket");
+			event_del(w->loop, fd);
+			close(fd);
+			/* the filters keep sending this worker its share of
+			 * the clients, without it they get no answer */
+			if (worker_listen(w) < 0) {
+				LOG(LOG_ERR, "FATAL: worker %d has no socket", w->id);
+				exit_code = 2;
+				event_loop_stop(w->loop);
+				event_loop_stop(&loop);
+			}
+		}
+		return;
+	}
+
+	/* the rest stays queued until the next wakeup */
+	for (i = 0; i < n; i++)
+		if (w->rx.bytes[i] >= 0)
+			handle_packet(&w->rx.packets[i], &w->rx.index[i]);
+
+	/* an OFFER may have started a probe */
+	pthread_mutex_lock(&server_lock);
+	probes_run();
+	pthread_mutex_unlock(&server_lock);
+	/* the leases are on disk before the replies granting them go out */
+	journal_commit();
+	tx_queue_flush(tx_queue);
+}
+
+
+#ifdef COMBINED_BINARY
+int udhcpd_main(int argc, char *argv[])
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	fd_set rfds;
+	struct option_set *option;
+	int arp_fd;
 	unsigned long num_ips;
-	uint32_t static_lease_ip;
 	char *config_file = DHCPD_CONF_FILE;
 	
 #ifndef COMBINED_BINARY
@@ -202,12 +506,39 @@ int main(int argc, char *argv[])
 	}
 
 	leases = xcalloc(server_config.max_leases, sizeof(struct dhcpOfferedAddr));
+	addr_pool_init(&addr_pool, server_config.start, server_config.end);
+	lease_shards_init(leases, server_config.max_leases);
+	reply_templates_init();
+
+#ifdef DHCPsql
+	/* a connection for each worker and one for the refreshes */
+	if (db_pool.size < workers.count + 1)
+		db_pool.size = workers.count + 1;
+
+	/* after the pool exists, loading static leases marks them reserved */
+	if (db_pool_init() < 0)
+		LOG(LOG_WARNING, "MySQL is not reachable, will keep retrying");
+	else {
+		static_cache_refresh(1);
+		option_cache_refresh(1);
+	}
+#endif
+
 	read_leases(server_config.lease_file);
+	/* fold what was replayed into the lease file, the journal starts over.
+	 * Before background(), the thread writing it doesn't survive fork() */
+	if (journal.enabled && journal_open() == 0) {
+		write_leases();
+		write_leases_wait();
+	}
 
 	if (read_interface(server_config.interface, &server_config.ifindex,
 			   &server_config.server, server_config.arp) < 0)
 		return 1;
 
+	arp_probe_init(server_config.server, server_config.arp, server_config.interface);
+	preprobe_init();
+
 #ifndef UDHCP_DEBUG
 	background(server_config.pidfile); /* hold lock during fork. */
 #endif
@@ -215,163 +546,43 @@ int main(int argc, char *argv[])
 	/* Setup the signal pipe */
 	udhcp_sp_setup();
 
-	timeout_end = time(0) + server_config.auto_time;
-	while(1) { /* loop until universe collapses */
-
-		if (server_socket < 0)
-			if ((server_socket = listen_socket(INADDR_ANY, SERVER_PORT, server_config.interface)) < 0) {
-				LOG(LOG_ERR, "FATAL: couldn't create server socket, %m");
-				return 2;
-			}
-
-		max_sock = udhcp_sp_fd_set(&rfds, server_socket);
-		if (server_config.auto_time) {
-			tv.tv_sec = timeout_end - time(0);
-			tv.tv_usec = 0;
-		}
-		if (!server_config.auto_time || tv.tv_sec > 0) {
-			retval = select(max_sock + 1, &rfds, NULL, NULL,
-					server_config.auto_time ? &tv : NULL);
-		} else retval = 0; /* If we already timed out, fall through */
-
-		if (retval == 0) {
-			write_leases();
-			timeout_end = time(0) + server_config.auto_time;
-			continue;
-		} else if (retval < 0 && errno != EINTR) {
-			DEBUG(LOG_INFO, "error on select");
-			continue;
-		}
-
-		switch (udhcp_sp_read(&rfds)) {
-		case SIGUSR1:
-			LOG(LOG_INFO, "Received a SIGUSR1");
-			write_leases();
-			/* why not just reset the timeout, eh */
-			timeout_end = time(0) + server_config.auto_time;
-			continue;
-		case SIGTERM:
-			LOG(LOG_INFO, "Received a SIGTERM");
-			return 0;
-		case 0: break;		/* no signal */
-		default: continue;	/* signal or error (probably EINTR) */
-		}
-
-		if ((bytes = get_packet(&packet, server_socket)) < 0) { /* this waits for a packet - idle */
-			if (bytes == -1 && errno != EINTR) {
-				DEBUG(LOG_INFO, "error on read, %m, reopening socket");
-				close(server_socket);
-				server_socket = -1;
-			}
-			continue;
-		}
-
-		if ((state = get_option(&packet, DHCP_MESSAGE_TYPE)) == NULL) {
-			DEBUG(LOG_ERR, "couldn't get option from packet, ignoring");
-			continue;
-		}
-
-		/* Look for a static lease */
-		static_lease_ip = getIpByMac(server_config.static_leases, &packet.chaddr);
-
-		if(static_lease_ip)
-		{
-			printf("Found static lease: %x\n", static_lease_ip);
-
-			memcpy(&static_lease.chaddr, &packet.chaddr, 16);
-			static_lease.yiaddr = static_lease_ip;
-			static_lease.expires = 0;
-
-			lease = &static_lease;
-
-		}
-		else
-		{
-		lease = find_lease_by_chaddr(packet.chaddr);
-		}
-
-		switch (state[0]) {
-		case DHCPDISCOVER:
-			DEBUG(LOG_INFO,"received DISCOVER");
-
-			if (sendOffer(&packet) < 0) {
-				LOG(LOG_ERR, "send OFFER failed");
-			}
-			break;
- 		case DHCPREQUEST:
-			DEBUG(LOG_INFO, "received REQUEST");
-
-			requested = get_option(&packet, DHCP_REQUESTED_IP);
-			server_id = get_option(&packet, DHCP_SERVER_ID);
-
-			if (requested) memcpy(&requested_align, requested, 4);
-			if (server_id) memcpy(&server_id_align, server_id, 4);
-
-			if (lease) {
-				if (server_id) {
-					/* SELECTING State */
-					DEBUG(LOG_INFO, "server_id = %08x", ntohl(server_id_align));
-					if (server_id_align == server_config.server && requested &&
-					    requested_align == lease->yiaddr) {
-						sendACK(&packet, lease->yiaddr);
-					}
-				} else {
-					if (requested) {
-						/* INIT-REBOOT State */
-						if (lease->yiaddr == requested_align)
-							sendACK(&packet, lease->yiaddr);
-						else sendNAK(&packet);
-					} else {
-						/* RENEWING or REBINDING State */
-						if (lease->yiaddr == packet.ciaddr)
-							sendACK(&packet, lease->yiaddr);
-						else {
-							/* don't know what to do!!!! */
-							sendNAK(&packet);
-						}
-					}
-				}
-
-			/* what to do if we have no record of the client */
-			} else if (server_id) {
-				/* SELECTING State */
-
-			} else if (requested) {
-				/* INIT-REBOOT State */
-				if ((lease = find_lease_by_yiaddr(requested_align))) {
-					if (lease_expired(lease)) {
-						/* probably best if we drop this lease */
-						memset(lease->chaddr, 0, 16);
-					/* make some contention for this address */
-					} else sendNAK(&packet);
-				} else if (requested_align < server_config.start ||
-					   requested_align > server_config.end) {
-					sendNAK(&packet);
-				} /* else remain silent */
+	if (event_loop_init(&loop) < 0)
+		return 2;
+	/* with no extra fd this hands back the signal pipe */
+	event_add(&loop, udhcp_sp_fd_set(&rfds, -1), signal_readable, NULL);
+	if ((arp_fd = arp_probe_fd()) >= 0)
+		event_add(&loop, arp_fd, arp_readable, NULL);
+	if (journal_wake_fd() >= 0)
+		event_add(&loop, journal_wake_fd(), journal_full, NULL);
+
+	if ((probe_timer = event_timer_new(&loop, probe_timeout, NULL)) < 0 ||
+	    (autosave_timer = event_timer_new(&loop, autosave, NULL)) < 0)
+		return 2;
+	timer_every(autosave_timer, server_config.auto_time);
+#ifdef DHCPsql
+	if ((refresh_timer = event_timer_new(&loop, static_refresh, NULL)) < 0 ||
+	    (options_timer = event_timer_new(&loop, options_refresh, NULL)) < 0)
+		return 2;
+	timer_every(refresh_timer, static_cache.refresh);
+	timer_every(options_timer, option_cache.refresh);
+#endif
+	notify_open(&loop);
+	probes_run();
 
-			} else {
-				 /* RENEWING or REBINDING State */
-			}
-			break;
-		case DHCPDECLINE:
-			DEBUG(LOG_INFO,"received DECLINE");
-			if (lease) {
-				memset(lease->chaddr, 0, 16);
-				lease->expires = time(0) + server_config.decline_time;
-			}
-			break;
-		case DHCPRELEASE:
-			DEBUG(LOG_INFO,"received RELEASE");
-			if (lease) lease->expires = time(0);
-			break;
-		case DHCPINFORM:
-			DEBUG(LOG_INFO,"received INFORM");
-			send_inform(&packet);
-			break;
-		default:
-			LOG(LOG_WARNING, "unsupported DHCP message (%02x) -- ignoring", state[0]);
-		}
+	/* the timers are set, workers may start handing out addresses */
+	if (workers_start(&loop, server_readable) < 0) {
+		LOG(LOG_ERR, "FATAL: couldn't start the workers");
+		return 2;
 	}
 
-	return 0;
+	event_loop_run(&loop); /* loop until universe collapses */
+	/* after a SIGTERM they are stopped already */
+	workers_stop();
+	/* a SIGUSR1 just before the SIGTERM still gets its lease file */
+	write_leases_wait();
+	notify_close();
+	event_loop_close(&loop);
+	journal_close();
+
+	return exit_code;
 }
@@ -11,6 +11,10 @@
 #include <time.h>
 #include <ctype.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <netinet/ether.h>
 #include "udhcp/static_leases.h"
@@ -19,6 +23,18 @@
 #include "udhcp/files.h"
 #include "udhcp/options.h"
 #include "udhcp/common.h"
+#include "udhcp/preprobe.h"
+#include "udhcp/packet_ring.h"
+#include "udhcp/worker.h"
+#include "udhcp/lease_shard.h"
+#include "udhcp/journal.h"
+#include "udhcp/lease_db.h"
+#include "udhcp/notify.h"
+#ifdef DHCPsql
+#include "udhcp/db_pool.h"
+#include "udhcp/static_cache.h"
+#include "udhcp/option_cache.h"
+#endif
 
 /*
  * Domain names may have 254 chars, and string options can be 254
@@ -209,18 +225,27 @@ static const struct config_keyword keywords[] = {
 	{"start",	read_ip,  &(server_config.start),	"192.168.0.20"},
 	{"end",		read_ip,  &(server_config.end),		"192.168.0.254"},
 	{"interface",	read_str, &(server_config.interface),	"eth0"},
+	{"packet_mmap",	read_yn,  &packet_mmap,			"no"},
+	{"workers",	read_u32, &(workers.count),		"1"},
+	{"lease_shards", read_u32, &(lease_shards.count),	"0"},
 	{"option",	read_opt, &(server_config.options),	""},
 	{"opt",		read_opt, &(server_config.options),	""},
 	{"max_leases",	read_u32, &(server_config.max_leases),	"254"},
 	{"remaining",	read_yn,  &(server_config.remaining),	"yes"},
 	{"auto_time",	read_u32, &(server_config.auto_time),	"7200"},
+	{"journal",	read_yn,  &(journal.enabled),		"yes"},
+	{"journal_size",read_u32, &(journal.max_size),		"1048576"},
 	{"decline_time",read_u32, &(server_config.decline_time),"3600"},
 	{"conflict_time",read_u32,&(server_config.conflict_time),"3600"},
 	{"offer_time",	read_u32, &(server_config.offer_time),	"60"},
+	{"preprobe_count",read_u32, &(preprobe.count),		"8"},
+	{"preprobe_rate",read_u32, &(preprobe.rate),		"10"},
 	{"min_lease",	read_u32, &(server_config.min_lease),	"60"},
 	{"lease_file",	read_str, &(server_config.lease_file),	LEASES_FILE},
 	{"pidfile",	read_str, &(server_config.pidfile),	"/var/run/udhcpd.pid"},
 	{"notify_file", read_str, &(server_config.notify_file),	""},
+	{"notify_socket", read_str, &(notify.socket),		""},
+	{"notify_queue", read_u32, &(notify.queue),		"4096"},
 	{"siaddr",	read_ip,  &(server_config.siaddr),	"0.0.0.0"},
 	{"sname",	read_str, &(server_config.sname),	""},
 	{"boot_file",	read_str, &(server_config.boot_file),	""},
@@ -234,6 +259,11 @@ static const struct config_keyword keywords[] = {
 	{"table_options", read_str, &(server_config.table_options), "options"},
 	{"table_staticleases", read_str, &(server_config.table_staticleases), "staticleases"},
 	{"table_efficient", read_yn, &(server_config.table_efficient), "yes"},
+	{"db_pool_size", read_u32, &(db_pool.size),		"2"},
+	{"db_ping_interval", read_u32, &(db_pool.ping_interval), "60"},
+	{"db_connect_timeout", read_u32, &(db_pool.connect_timeout), "5"},
+	{"static_refresh", read_u32, &(static_cache.refresh),	"300"},
+	{"option_refresh", read_u32, &(option_cache.refresh),	"300"},
 #endif
 	{"",		NULL, 	  NULL,				""}
 };
@@ -288,69 +318,162 @@ int read_config(const char *file)
 }
 
 
-void write_leases(void)
+/* the lease table as it goes in the lease file, taken under the locks
+ * and written out by another thread */
+struct lease_snapshot {
+	struct dhcpOfferedAddr *leases;
+	unsigned int count, size;
+};
+
+static pthread_t snapshot_thread;
+static int snapshot_running;
+
+
+/* add a lease with expires in file order */
+static void snapshot_lease(struct lease_snapshot *snap, struct dhcpOfferedAddr *lease, time_t curr)
 {
-	FILE *fp;
-	unsigned int i;
-	char buf[255];
-	time_t curr = time(0);
-	unsigned long tmp_time;
+	struct dhcpOfferedAddr *copy;
 
-	if (!(fp = fopen(server_config.lease_file, "w"))) {
-		LOG(LOG_ERR, "Unable to open %s for writing", server_config.lease_file);
-		return;
+	if (snap->count == snap->size) {
+		snap->size = snap->size ? snap->size * 2 : 64;
+		snap->leases = xrealloc(snap->leases, snap->size * sizeof(struct dhcpOfferedAddr));
 	}
+	copy = &snap->leases[snap->count++];
+	memcpy(copy, lease, sizeof(struct dhcpOfferedAddr));
+
+	if (server_config.remaining) {
+		if (lease_expired(lease))
+			copy->expires = 0;
+		else copy->expires -= curr;
+	} /* else stick with the time we got */
+	copy->expires = htonl(copy->expires);
+}
 
-	for (i = 0; i < server_config.max_leases; i++) {
-		if (leases[i].yiaddr != 0) {
 
-			/* screw with the time in the struct, for easier writing */
-			tmp_time = leases[i].expires;
+/* write to a temporary file and rename it over the lease file, which
+ * stays whole until the new one is on disk */
+static void *snapshot_write(void *arg)
+{
+	struct lease_snapshot *snap = arg;
+	char *tmp;
+	FILE *fp;
+	int ok;
+
+	tmp = xmalloc(strlen(server_config.lease_file) + sizeof(".tmp"));
+	sprintf(tmp, "%s.tmp", server_config.lease_file);
+
+	if (!(fp = fopen(tmp, "w"))) {
+		LOG(LOG_ERR, "Unable to open %s for writing", tmp);
+		ok = 0;
+	} else {
+		ok = lease_db_write(fp, snap->leases, snap->count,
+				    server_config.remaining ? LEASE_DB_REMAINING : 0) == 0 &&
+		     fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+		if (fclose(fp) != 0) ok = 0;
+		if (!ok || rename(tmp, server_config.lease_file) < 0 ||
+		    sync_dir(server_config.lease_file) < 0) {
+			LOG(LOG_ERR, "Unable to write %s, %m", server_config.lease_file);
+			unlink(tmp);
+			ok = 0;
+		}
+	}
+	free(tmp);
+	free(snap->leases);
+	free(snap);
+
+	if (!ok) return NULL;
+	/* the records the file was taken after aren't needed anymore */
+	journal_snapshot_done();
+	notify_snapshot();
+	return NULL;
+}
 
-			if (server_config.remaining) {
-				if (lease_expired(&(leases[i])))
-					leases[i].expires = 0;
-				else leases[i].expires -= curr;
-			} /* else stick with the time we got */
-			leases[i].expires = htonl(leases[i].expires);
-			fwrite(&leases[i], sizeof(struct dhcpOfferedAddr), 1, fp);
 
-			/* Then restore it when done. */
-			leases[i].expires = tmp_time;
+void write_leases(void)
+{
+	struct lease_snapshot *snap;
+	unsigned int i;
+	time_t curr = time(0);
+	struct dhcpOfferedAddr reserved;
+	uint32_t expires;
+
+	/* one at a time, the next autosave catches up */
+	if (snapshot_running) {
+		if (pthread_tryjoin_np(snapshot_thread, NULL) == EBUSY) {
+			LOG(LOG_INFO, "Still writing %s, skipping this one", server_config.lease_file);
+			return;
 		}
+		snapshot_running = 0;
 	}
-	fclose(fp);
 
-	if (server_config.notify_file) {
-		sprintf(buf, "%s %s", server_config.notify_file, server_config.lease_file);
-		system(buf);
+	snap = xcalloc(1, sizeof(struct lease_snapshot));
+	lease_shards_lock();
+	for (i = 0; i < server_config.max_leases; i++) {
+		/* leases whose address went to another shard are left out */
+		if (leases[i].yiaddr != 0 && lease_current(&leases[i]))
+			snapshot_lease(snap, &leases[i], curr);
 	}
+
+	/* conflicts and declined addresses, as leases with a blank chaddr */
+	memset(&reserved, 0, sizeof(reserved));
+	while ((reserved.yiaddr = lease_reserved_next(reserved.yiaddr, &expires))) {
+		reserved.expires = expires;
+		snapshot_lease(snap, &reserved, curr);
+	}
+
+	/* changes from here on aren't in the snapshot */
+	journal_rotate();
+	lease_shards_unlock();
+
+	/* the workers keep answering while it is written */
+	if (pthread_create(&snapshot_thread, NULL, snapshot_write, snap)) {
+		LOG(LOG_WARNING, "Could not start a thread to write %s, %m", server_config.lease_file);
+		snapshot_write(snap);
+	} else snapshot_running = 1;
+}
+
+
+void write_leases_wait(void)
+{
+	if (!snapshot_running) return;
+	pthread_join(snapshot_thread, NULL);
+	snapshot_running = 0;
 }
 
 
 void read_leases(const char *file)
 {
 	FILE *fp;
-	unsigned int i = 0;
-	struct dhcpOfferedAddr lease;
+	struct lease_db db;
+	struct stat st;
+	struct dhcpOfferedAddr *records;
+	uint32_t count, loaded = 0, full = 0;
+	int replayed, ret;
+
+	lease_shards_lock();
+	/* the records are used where they are mapped. The file says how
+	 * its times are kept */
+	if ((ret = lease_db_open(&db, file)) == 0) {
+		loaded = lease_load(db.records, db.count, db.flags & LEASE_DB_REMAINING, &full);
+		lease_db_close(&db);
+
+	/* a lease file from before the header, read in one go */
+	} else if (ret == -2 && (fp = fopen(file, "r"))) {
+		if (fstat(fileno(fp), &st) == 0 && st.st_size >= (off_t) sizeof(struct dhcpOfferedAddr)) {
+			records = xmalloc(st.st_size);
+			count = fread(records, sizeof(struct dhcpOfferedAddr),
+				      st.st_size / sizeof(struct dhcpOfferedAddr), fp);
+			loaded = lease_load(records, count, server_config.remaining, &full);
+			free(records);
+		}
+		fclose(fp);
 
-	if (!(fp = fopen(file, "r"))) {
-		LOG(LOG_ERR, "Unable to open %s for reading", file);
-		return;
-	}
+	/* the journal may hold leases all the same */
+	} else LOG(LOG_ERR, "Unable to open %s for reading", file);
 
-	while (i < server_config.max_leases && (fread(&lease, sizeof lease, 1, fp) == 1)) {
-		/* ADDME: is it a static lease */
-		if (lease.yiaddr >= server_config.start && lease.yiaddr <= server_config.end) {
-			lease.expires = ntohl(lease.expires);
-			if (!server_config.remaining) lease.expires -= time(0);
-			if (!(add_lease(lease.chaddr, lease.yiaddr, lease.expires))) {
-				LOG(LOG_WARNING, "Too many leases while loading %s\n", file);
-				break;
-			}
-			i++;
-		}
-	}
-	DEBUG(LOG_INFO, "Read %d leases", i);
-	fclose(fp);
+	replayed = journal_replay();
+	lease_shards_unlock();
+	if (full)
+		LOG(LOG_WARNING, "Too many leases while loading %s, %u dropped", file, full);
+	DEBUG(LOG_INFO, "Read %u leases, replayed %d journal records", loaded, replayed);
 }
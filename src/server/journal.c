@@ -0,0 +1,321 @@
+/*
+ * journal.c -- write-ahead journal of lease changes
+ *
+ * The lease file is only written every auto_time seconds, so a crash
+ * lost every lease handed out since. Every change to the lease table
+ * is now also appended to <lease_file>.journal as a small record. The
+ * workers commit the journal before sending the replies of a batch;
+ * whoever gets there first writes and fsyncs for everyone waiting.
+ * Writing the lease file folds the journal into it, when auto_time
+ * comes round or sooner once it outgrows journal_size: a new journal
+ * is started and the old one is removed once the file is on disk.
+ * read_leases() replays both on top of the lease file at startup.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/checksum.h"
+#include "udhcp/lease_shard.h"
+#include "udhcp/journal.h"
+
+struct journal_buffer {
+	struct journal_record *r;
+	int count, size;
+};
+
+struct journal_t journal;
+
+static int fd = -1, wake = -1;
+static char *path, *old_path;
+static int old_kept;		/* old_path waits for the lease file */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t synced_cond = PTHREAD_COND_INITIALIZER;
+/* records taken while the other buffer is being written */
+static struct journal_buffer buffers[2], *pending = &buffers[0], *writing = &buffers[1];
+static uint64_t appended, synced;	/* records so far */
+static int syncing, woken;
+static off_t size;			/* bytes in the file */
+
+
+static void journal_paths(void)
+{
+	if (path) return;
+	path = xmalloc(strlen(server_config.lease_file) + sizeof(".journal"));
+	sprintf(path, "%s.journal", server_config.lease_file);
+	old_path = xmalloc(strlen(path) + sizeof(".old"));
+	sprintf(old_path, "%s.old", path);
+}
+
+
+int sync_dir(const char *file)
+{
+	char *copy = xstrdup(file);
+	int dir, ret = -1;
+
+	if ((dir = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+		ret = fsync(dir);
+		close(dir);
+	}
+	free(copy);
+	return ret;
+}
+
+
+int journal_open(void)
+{
+	if (!journal.enabled) return 0;
+
+	journal_paths();
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+		LOG(LOG_ERR, "Unable to open the lease journal %s, %m", path);
+		return -1;
+	}
+	size = lseek(fd, 0, SEEK_END);
+	old_kept = access(old_path, F_OK) == 0;
+
+	/* without it the journal is only folded every auto_time seconds */
+	if (journal.max_size && (wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		LOG(LOG_WARNING, "Could not watch the lease journal size, %m");
+	return 0;
+}
+
+
+void journal_close(void)
+{
+	if (fd < 0) return;
+	journal_commit();
+	close(fd);
+	fd = -1;
+	if (wake >= 0) close(wake);
+	wake = -1;
+}
+
+
+int journal_wake_fd(void)
+{
+	return wake;
+}
+
+
+static void append(uint8_t type, uint32_t yiaddr, uint32_t expires, uint8_t *chaddr)
+{
+	struct journal_record *rec;
+
+	/* not open yet while read_leases() replays it */
+	if (fd < 0) return;
+
+	pthread_mutex_lock(&lock);
+	if (pending->count == pending->size) {
+		pending->size = pending->size ? pending->size * 2 : 64;
+		pending->r = xrealloc(pending->r, pending->size * sizeof(struct journal_record));
+	}
+	rec = &pending->r[pending->count++];
+	memset(rec, 0, sizeof(struct journal_record));
+	rec->type = type;
+	rec->yiaddr = yiaddr;
+	rec->expires = htonl(expires);
+	if (chaddr) memcpy(rec->chaddr, chaddr, 16);
+	rec->check = checksum(rec, sizeof(struct journal_record));
+	appended++;
+	pthread_mutex_unlock(&lock);
+}
+
+
+void journal_lease(struct dhcpOfferedAddr *lease)
+{
+	append(JOURNAL_LEASE, lease->yiaddr, lease->expires, lease->chaddr);
+}
+
+
+void journal_reserve(uint32_t yiaddr, uint32_t expires)
+{
+	append(JOURNAL_RESERVE, yiaddr, expires, NULL);
+}
+
+
+static int write_all(uint8_t *data, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, data, len)) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+void journal_commit(void)
+{
+	struct journal_buffer *buf;
+	uint64_t want, upto;
+	uint64_t one = 1;
+	int failed;
+
+	if (fd < 0) return;
+
+	pthread_mutex_lock(&lock);
+	want = appended;
+	while (synced < want) {
+		/* the thread syncing now may not have our records, wait and see */
+		if (syncing) {
+			pthread_cond_wait(&synced_cond, &lock);
+			continue;
+		}
+
+		syncing = 1;
+		buf = pending;
+		pending = writing;
+		writing = buf;
+		upto = appended;
+		pthread_mutex_unlock(&lock);
+
+		failed = write_all((uint8_t *) buf->r, buf->count * sizeof(struct journal_record)) < 0 ||
+			 fdatasync(fd) < 0;
+		if (failed) {
+			/* the leases are granted anyway, the lease file still gets
+			 * them. A torn record would hide every later one from
+			 * replay, cut back to the last whole one */
+			LOG(LOG_ERR, "Unable to write the lease journal %s, %m", path);
+			if (ftruncate(fd, size) < 0)
+				LOG(LOG_ERR, "Unable to truncate the lease journal %s, %m", path);
+		}
+
+		pthread_mutex_lock(&lock);
+		if (failed) {
+			/* retried ahead of what came meanwhile by the next commit */
+			if (buf->size < buf->count + pending->count) {
+				buf->size = buf->count + pending->count;
+				buf->r = xrealloc(buf->r, buf->size * sizeof(struct journal_record));
+			}
+			if (pending->count)
+				memcpy(buf->r + buf->count, pending->r,
+				       pending->count * sizeof(struct journal_record));
+			buf->count += pending->count;
+			pending->count = 0;
+			writing = pending;
+			pending = buf;
+		} else {
+			size += buf->count * sizeof(struct journal_record);
+			buf->count = 0;
+			synced = upto;
+		}
+		syncing = 0;
+		if (wake >= 0 && !woken && size >= (off_t) journal.max_size) {
+			woken = 1;
+			if (write(wake, &one, sizeof(one)) < 0)
+				DEBUG(LOG_ERR, "Could not ask for an early lease file: %m");
+		}
+		pthread_cond_broadcast(&synced_cond);
+		/* don't spin on a failing disk, the waiters try once each */
+		if (failed) break;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+static int replay(const char *file)
+{
+	struct journal_record rec;
+	struct dhcpOfferedAddr *lease;
+	uint32_t now = time(0), expires;
+	FILE *fp;
+	int n = 0;
+
+	if (!(fp = fopen(file, "r")))
+		return 0;
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		/* a record sums to 0 with its checksum, a torn one ends the journal */
+		if (checksum(&rec, sizeof(rec)) != 0) {
+			LOG(LOG_WARNING, "Lease journal %s ends in a damaged record", file);
+			break;
+		}
+
+		expires = ntohl(rec.expires);
+		switch (rec.type) {
+		case JOURNAL_LEASE:
+			if ((lease = add_lease(rec.chaddr, rec.yiaddr, 0)))
+				lease_set_expires(lease, expires);
+			break;
+		case JOURNAL_RESERVE:
+			lease_reserve(rec.yiaddr, expires > now ? expires - now : 0);
+			break;
+		default:
+			continue;
+		}
+		n++;
+	}
+	fclose(fp);
+	return n;
+}
+
+
+int journal_replay(void)
+{
+	if (!journal.enabled) return 0;
+
+	/* the lease file may not have made it to disk after the rotation */
+	journal_paths();
+	return replay(old_path) + replay(path);
+}
+
+
+void journal_rotate(void)
+{
+	int new;
+
+	if (fd < 0) return;
+
+	pthread_mutex_lock(&lock);
+	/* a sync still running would write to the old one */
+	while (syncing)
+		pthread_cond_wait(&synced_cond, &lock);
+
+	/* what is still pending goes to the new one, replaying a record the
+	 * lease file already has does no harm */
+	if (old_kept) {
+		LOG(LOG_WARNING, "Lease file not written since the last rotation, %s keeps growing", path);
+	} else if (rename(path, old_path) < 0) {
+		LOG(LOG_ERR, "Unable to rotate the lease journal %s, %m", path);
+	} else if ((new = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+		LOG(LOG_ERR, "Unable to open the lease journal %s, %m", path);
+		rename(old_path, path);
+	} else {
+		close(fd);
+		fd = new;
+		size = 0;
+		old_kept = 1;
+		if (sync_dir(path) < 0)
+			LOG(LOG_ERR, "Unable to sync the lease journal's directory, %m");
+	}
+	/* still over max_size, the next commit asks again */
+	woken = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+
+void journal_snapshot_done(void)
+{
+	pthread_mutex_lock(&lock);
+	if (old_kept && unlink(old_path) == 0)
+		old_kept = 0;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,234 @@
+/*
+ * lease_index.c -- hash indexes over the lease table
+ *
+ * Finding a lease by chaddr or yiaddr used to be a pass over all
+ * max_leases entries, and add_lease() needed several of them. Both
+ * keys are kept in linear probing tables of lease numbers; deletion
+ * shifts the following entries back so no tombstones build up.
+ *
+ * Picking a slot to reuse used to be another full pass for the lowest
+ * expires. An indexed binary heap keeps that lease on top, and moving
+ * a lease after it was renewed or released is O(log n).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/lease_index.h"
+
+enum { BY_CHADDR, BY_YIADDR };
+
+
+uint32_t lease_index_hash_chaddr(uint8_t *chaddr)
+{
+	uint64_t a, b;
+
+	memcpy(&a, chaddr, 8);
+	memcpy(&b, chaddr + 8, 8);
+	a ^= b * 0x9e3779b97f4a7c15ULL;
+	a ^= a >> 31;
+	a *= 0xbf58476d1ce4e5b9ULL;
+	return a ^ (a >> 29);
+}
+
+
+static uint32_t hash_yiaddr(uint32_t yiaddr)
+{
+	yiaddr = (yiaddr ^ (yiaddr >> 16)) * 0x45d9f3b;
+	return yiaddr ^ (yiaddr >> 16);
+}
+
+
+static int blank(uint8_t *chaddr)
+{
+	return !memcmp(chaddr, blank_chaddr, 16);
+}
+
+
+static uint32_t home(struct lease_index *idx, int which, int32_t n)
+{
+	if (which == BY_CHADDR)
+		return lease_index_hash_chaddr(idx->leases[n].chaddr) & idx->mask;
+	return hash_yiaddr(idx->leases[n].yiaddr) & idx->mask;
+}
+
+
+static void table_insert(struct lease_index *idx, int which, int32_t n)
+{
+	int32_t *table = which == BY_CHADDR ? idx->by_chaddr : idx->by_yiaddr;
+	uint32_t i;
+
+	for (i = home(idx, which, n); table[i] >= 0; i = (i + 1) & idx->mask);
+	table[i] = n;
+}
+
+
+static void table_remove(struct lease_index *idx, int which, int32_t n)
+{
+	int32_t *table = which == BY_CHADDR ? idx->by_chaddr : idx->by_yiaddr;
+	uint32_t i, j, h;
+
+	for (i = home(idx, which, n); table[i] != n; i = (i + 1) & idx->mask)
+		if (table[i] < 0) return;	/* wasn't indexed */
+
+	/* pull back whatever probed past the hole */
+	for (j = (i + 1) & idx->mask; table[j] >= 0; j = (j + 1) & idx->mask) {
+		h = home(idx, which, table[j]);
+		if (((j - h) & idx->mask) >= ((j - i) & idx->mask)) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i] = -1;
+}
+
+
+#define EXPIRES(idx, i) ((idx)->leases[(idx)->heap[i]].expires)
+
+static void heap_swap(struct lease_index *idx, uint32_t a, uint32_t b)
+{
+	int32_t n = idx->heap[a];
+
+	idx->heap[a] = idx->heap[b];
+	idx->heap[b] = n;
+	idx->heap_pos[idx->heap[a]] = a;
+	idx->heap_pos[idx->heap[b]] = b;
+}
+
+
+static void heap_down(struct lease_index *idx, uint32_t i)
+{
+	uint32_t child;
+
+	while ((child = 2 * i + 1) < idx->count) {
+		if (child + 1 < idx->count && EXPIRES(idx, child + 1) < EXPIRES(idx, child))
+			child++;
+		if (EXPIRES(idx, i) <= EXPIRES(idx, child))
+			break;
+		heap_swap(idx, i, child);
+		i = child;
+	}
+}
+
+
+/* move heap entry i to where its expires belongs */
+static void heap_fix(struct lease_index *idx, uint32_t i)
+{
+	while (i > 0 && EXPIRES(idx, i) < EXPIRES(idx, (i - 1) / 2)) {
+		heap_swap(idx, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	heap_down(idx, i);
+}
+
+
+/* the lease number, -1 for leases that don't live in the array (the
+ * static lease dhcpd.c fakes on its stack) */
+static int32_t lease_number(struct lease_index *idx, struct dhcpOfferedAddr *lease)
+{
+	if (lease < idx->leases || lease >= idx->leases + idx->count)
+		return -1;
+	return lease - idx->leases;
+}
+
+
+void lease_index_init(struct lease_index *idx, struct dhcpOfferedAddr *leases, uint32_t count)
+{
+	uint32_t size = 16, i;
+
+	free(idx->by_chaddr);
+	free(idx->by_yiaddr);
+	free(idx->heap);
+	free(idx->heap_pos);
+
+	/* keep the load at or below one half */
+	while (size < count * 2) size <<= 1;
+
+	idx->leases = leases;
+	idx->count = count;
+	idx->mask = size - 1;
+	idx->by_chaddr = xmalloc(size * sizeof(int32_t));
+	idx->by_yiaddr = xmalloc(size * sizeof(int32_t));
+	memset(idx->by_chaddr, 0xff, size * sizeof(int32_t));
+	memset(idx->by_yiaddr, 0xff, size * sizeof(int32_t));
+	idx->heap = xmalloc((count ? count : 1) * sizeof(int32_t));
+	idx->heap_pos = xmalloc((count ? count : 1) * sizeof(int32_t));
+
+	for (i = 0; i < count; i++) {
+		idx->heap[i] = idx->heap_pos[i] = i;
+		lease_index_insert(idx, &leases[i]);
+	}
+	for (i = count / 2; i-- > 0;)
+		heap_down(idx, i);
+}
+
+
+void lease_index_insert(struct lease_index *idx, struct dhcpOfferedAddr *lease)
+{
+	int32_t n;
+
+	if ((n = lease_number(idx, lease)) < 0) return;
+	if (!blank(lease->chaddr)) table_insert(idx, BY_CHADDR, n);
+	if (lease->yiaddr) table_insert(idx, BY_YIADDR, n);
+}
+
+
+void lease_index_remove(struct lease_index *idx, struct dhcpOfferedAddr *lease)
+{
+	int32_t n;
+
+	if ((n = lease_number(idx, lease)) < 0) return;
+	if (!blank(lease->chaddr)) table_remove(idx, BY_CHADDR, n);
+	if (lease->yiaddr) table_remove(idx, BY_YIADDR, n);
+}
+
+
+struct dhcpOfferedAddr *lease_index_chaddr(struct lease_index *idx, uint8_t *chaddr)
+{
+	uint32_t i;
+
+	for (i = lease_index_hash_chaddr(chaddr) & idx->mask; idx->by_chaddr[i] >= 0; i = (i + 1) & idx->mask)
+		if (!memcmp(idx->leases[idx->by_chaddr[i]].chaddr, chaddr, 16))
+			return &idx->leases[idx->by_chaddr[i]];
+	return NULL;
+}
+
+
+struct dhcpOfferedAddr *lease_index_yiaddr(struct lease_index *idx, uint32_t yiaddr)
+{
+	uint32_t i;
+
+	for (i = hash_yiaddr(yiaddr) & idx->mask; idx->by_yiaddr[i] >= 0; i = (i + 1) & idx->mask)
+		if (idx->leases[idx->by_yiaddr[i]].yiaddr == yiaddr)
+			return &idx->leases[idx->by_yiaddr[i]];
+	return NULL;
+}
+
+
+struct dhcpOfferedAddr *lease_index_oldest(struct lease_index *idx)
+{
+	if (!idx->count) return NULL;
+	return &idx->leases[idx->heap[0]];
+}
+
+
+void lease_index_set_expires(struct lease_index *idx, struct dhcpOfferedAddr *lease, uint32_t expires)
+{
+	int32_t n;
+
+	lease->expires = expires;
+	if ((n = lease_number(idx, lease)) >= 0)
+		heap_fix(idx, idx->heap_pos[n]);
+}
+
+
+void lease_index_clear_chaddr(struct lease_index *idx, struct dhcpOfferedAddr *lease)
+{
+	int32_t n;
+
+	if ((n = lease_number(idx, lease)) >= 0 && !blank(lease->chaddr))
+		table_remove(idx, BY_CHADDR, n);
+	memset(lease->chaddr, 0, 16);
+}
@@ -0,0 +1,139 @@
+/*
+ * lease_shard.c -- the lease table split by chaddr
+ *
+ * With several workers every request used to wait for server_lock,
+ * held for the whole request, MySQL queries included. The lease array
+ * is now cut into shards, each with its own lock and indexes, and a
+ * client's lease lives in the shard its chaddr hashes to. The hash is
+ * the one the workers' socket filters use, so with as many shards as
+ * workers each shard is only ever locked by its own worker.
+ *
+ * An address may move to a client of another shard. Who holds each
+ * address is kept in one owner table under server_lock; the lease
+ * left behind in the old shard no longer owns its address and is
+ * thrown away the next time its shard looks at it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/worker.h"
+#include "udhcp/lease_shard.h"
+
+struct lease_shards_t lease_shards;
+
+static struct dhcpOfferedAddr *array;
+
+
+void lease_shards_init(struct dhcpOfferedAddr *leases, uint32_t count)
+{
+	struct lease_shard *shard;
+	uint32_t i, first = 0, n;
+
+	if (!lease_shards.count) lease_shards.count = workers.count ? workers.count : 1;
+	if (lease_shards.count > count) lease_shards.count = count ? count : 1;
+
+	array = leases;
+	lease_shards.total = count;
+	lease_shards.s = xcalloc(lease_shards.count, sizeof(struct lease_shard));
+	for (i = 0; i < lease_shards.count; i++) {
+		shard = &lease_shards.s[i];
+		/* the first count % shards get one more */
+		n = count / lease_shards.count + (i < count % lease_shards.count);
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->first = first;
+		lease_index_init(&shard->index, leases + first, n);
+		first += n;
+	}
+
+	lease_shards.start = ntohl(server_config.start);
+	lease_shards.size = ntohl(server_config.end) - lease_shards.start + 1;
+	lease_shards.owner = xmalloc(lease_shards.size * sizeof(struct lease_owner));
+	for (i = 0; i < lease_shards.size; i++) {
+		lease_shards.owner[i].lease = -1;
+		lease_shards.owner[i].expires = 0;
+	}
+}
+
+
+struct lease_shard *lease_shard(uint8_t *chaddr)
+{
+	uint32_t hash;
+
+	if (lease_shards.count == 1) return lease_shards.s;
+
+	/* chaddr[2..5] as the filters load it */
+	hash = chaddr[2] << 24 | chaddr[3] << 16 | chaddr[4] << 8 | chaddr[5];
+	return &lease_shards.s[hash % lease_shards.count];
+}
+
+
+struct lease_shard *lease_shard_of(struct dhcpOfferedAddr *lease)
+{
+	uint32_t n, per, big;
+
+	if (lease < array || lease >= array + lease_shards.total)
+		return NULL;
+
+	n = lease - array;
+	per = lease_shards.total / lease_shards.count;
+	big = lease_shards.total % lease_shards.count;
+	if (n < big * (per + 1))
+		return &lease_shards.s[n / (per + 1)];
+	return &lease_shards.s[big + (n - big * (per + 1)) / per];
+}
+
+
+void lease_shards_lock(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < lease_shards.count; i++)
+		pthread_mutex_lock(&lease_shards.s[i].lock);
+	pthread_mutex_lock(&server_lock);
+}
+
+
+void lease_shards_unlock(void)
+{
+	uint32_t i;
+
+	pthread_mutex_unlock(&server_lock);
+	for (i = lease_shards.count; i-- > 0;)
+		pthread_mutex_unlock(&lease_shards.s[i].lock);
+}
+
+
+struct lease_owner *lease_owner(uint32_t yiaddr)
+{
+	uint32_t off = ntohl(yiaddr) - lease_shards.start;
+
+	if (off >= lease_shards.size) return NULL;
+	return &lease_shards.owner[off];
+}
+
+
+int lease_current(struct dhcpOfferedAddr *lease)
+{
+	struct lease_owner *owner;
+
+	/* addresses outside the pool aren't tracked, nobody takes them */
+	if (!(owner = lease_owner(lease->yiaddr))) return 1;
+	return owner->lease == lease - array;
+}
+
+
+uint32_t lease_reserved_next(uint32_t ip, uint32_t *expires)
+{
+	uint32_t off = ip ? ntohl(ip) - lease_shards.start + 1 : 0;
+
+	for (; off < lease_shards.size; off++)
+		if (lease_shards.owner[off].lease < 0 && lease_shards.owner[off].expires) {
+			*expires = lease_shards.owner[off].expires;
+			return htonl(lease_shards.start + off);
+		}
+	return 0;
+}
@@ -3,6 +3,7 @@
  * Russ Dill <Russ.Dill@asu.edu> July 2001
  */
 
+#include <stdlib.h>
 #include <time.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -15,41 +16,91 @@
 #include "udhcp/leases.h"
 #include "udhcp/arpping.h"
 #include "udhcp/common.h"
+#include "udhcp/lease_index.h"
+#include "udhcp/lease_shard.h"
+#include "udhcp/addr_pool.h"
+#include "udhcp/arp_probe.h"
+#include "udhcp/journal.h"
+#include "udhcp/notify.h"
 
 #include "udhcp/static_leases.h"
 
 
 uint8_t blank_chaddr[] = {[0 ... 15] = 0};
 
-/* clear every lease out that chaddr OR yiaddr matches and is nonzero */
-void clear_lease(uint8_t *chaddr, uint32_t yiaddr)
+/* Every function here that changes a lease is called with the lease's
+ * shard lock and server_lock held, so holding either is enough to read
+ * one. The changes that outlive a restart go to the journal. */
+
+/* take a lease out of its shard, giving its address back if it still
+ * holds it */
+static void lease_free(struct lease_index *idx, struct dhcpOfferedAddr *lease)
 {
-	unsigned int i, j;
+	struct lease_owner *owner;
+
+	lease_index_remove(idx, lease);
+	if (lease_current(lease)) {
+		if ((owner = lease_owner(lease->yiaddr))) {
+			owner->lease = -1;
+			owner->expires = 0;
+		}
+		addr_pool_mark(&addr_pool, ADDR_USED, lease->yiaddr, 0);
+	}
+	memset(lease, 0, sizeof(struct dhcpOfferedAddr));
+	lease_index_set_expires(idx, lease, 0);
+}
 
-	for (j = 0; j < 16 && !chaddr[j]; j++);
 
-	for (i = 0; i < server_config.max_leases; i++)
-		if ((j != 16 && !memcmp(leases[i].chaddr, chaddr, 16)) ||
-		    (yiaddr && leases[i].yiaddr == yiaddr)) {
-			memset(&(leases[i]), 0, sizeof(struct dhcpOfferedAddr));
+/* clear every lease out that chaddr OR yiaddr matches and is nonzero */
+void clear_lease(uint8_t *chaddr, uint32_t yiaddr)
+{
+	struct lease_index *idx = &lease_shard(chaddr)->index;
+	struct dhcpOfferedAddr *lease;
+	struct lease_owner *owner;
+
+	if (memcmp(chaddr, blank_chaddr, 16))
+		while ((lease = lease_index_chaddr(idx, chaddr)))
+			lease_free(idx, lease);
+
+	if (yiaddr) {
+		while ((lease = lease_index_yiaddr(idx, yiaddr)))
+			lease_free(idx, lease);
+
+		/* held in another shard, or reserved, that lease goes stale */
+		if ((owner = lease_owner(yiaddr)) && (owner->lease >= 0 || owner->expires)) {
+			owner->lease = -1;
+			owner->expires = 0;
+			addr_pool_mark(&addr_pool, ADDR_USED, yiaddr, 0);
 		}
+	}
 }
 
 
 /* add a lease into the table, clearing out any old ones */
 struct dhcpOfferedAddr *add_lease(uint8_t *chaddr, uint32_t yiaddr, unsigned long lease)
 {
+	struct lease_index *idx = &lease_shard(chaddr)->index;
 	struct dhcpOfferedAddr *oldest;
+	struct lease_owner *owner;
 
 	/* clean out any old ones */
 	clear_lease(chaddr, yiaddr);
 
-	oldest = oldest_expired_lease();
+	oldest = oldest_expired_lease(chaddr);
 
 	if (oldest) {
+		lease_free(idx, oldest);
 		memcpy(oldest->chaddr, chaddr, 16);
 		oldest->yiaddr = yiaddr;
-		oldest->expires = time(0) + lease;
+		lease_index_insert(idx, oldest);
+		if ((owner = lease_owner(yiaddr))) {
+			owner->lease = oldest - leases;
+			owner->expires = 0;
+		}
+		addr_pool_mark(&addr_pool, ADDR_USED, yiaddr, 1);
+		lease_index_set_expires(idx, oldest, time(0) + lease);
+		journal_lease(oldest);
+		notify_lease(oldest);
 	}
 
 	return oldest;
@@ -63,58 +114,206 @@ int lease_expired(struct dhcpOfferedAddr *lease)
 }
 
 
-/* Find the oldest expired lease, NULL if there are no expired leases */
-struct dhcpOfferedAddr *oldest_expired_lease(void)
+/* Find the oldest expired lease in chaddr's shard, NULL if there are no
+ * expired leases */
+struct dhcpOfferedAddr *oldest_expired_lease(uint8_t *chaddr)
 {
-	struct dhcpOfferedAddr *oldest = NULL;
-	unsigned long oldest_lease = time(0);
-	unsigned int i;
-
-
-	for (i = 0; i < server_config.max_leases; i++)
-		if (oldest_lease > leases[i].expires) {
-			oldest_lease = leases[i].expires;
-			oldest = &(leases[i]);
-		}
-	return oldest;
+	struct dhcpOfferedAddr *oldest = lease_index_oldest(&lease_shard(chaddr)->index);
 
+	if (oldest && oldest->expires < (unsigned long) time(0))
+		return oldest;
+	return NULL;
 }
 
 
-/* Find the first lease that matches chaddr, NULL if no match */
+/* Find the lease that matches chaddr, NULL if no match. Blank chaddrs
+ * are reservations, they have no lease */
 struct dhcpOfferedAddr *find_lease_by_chaddr(uint8_t *chaddr)
 {
-	unsigned int i;
+	struct lease_index *idx = &lease_shard(chaddr)->index;
+	struct dhcpOfferedAddr *lease;
 
-	for (i = 0; i < server_config.max_leases; i++)
-		if (!memcmp(leases[i].chaddr, chaddr, 16)) return &(leases[i]);
+	if (!memcmp(chaddr, blank_chaddr, 16) || !(lease = lease_index_chaddr(idx, chaddr)))
+		return NULL;
 
-	return NULL;
+	/* a client of another shard was given its address */
+	if (!lease_current(lease)) {
+		lease_free(idx, lease);
+		return NULL;
+	}
+	return lease;
 }
 
 
-/* Find the first lease that matches yiaddr, NULL is no match */
+/* Find the lease that holds yiaddr in any shard, NULL is no match */
 struct dhcpOfferedAddr *find_lease_by_yiaddr(uint32_t yiaddr)
 {
-	unsigned int i;
+	struct lease_owner *owner;
+
+	if (!(owner = lease_owner(yiaddr)) || owner->lease < 0)
+		return NULL;
+	return &leases[owner->lease];
+}
 
-	for (i = 0; i < server_config.max_leases; i++)
-		if (leases[i].yiaddr == yiaddr) return &(leases[i]);
 
-	return NULL;
+/* true if an unexpired lease or reservation holds yiaddr */
+int lease_taken(uint32_t yiaddr)
+{
+	struct dhcpOfferedAddr *lease;
+	struct lease_owner *owner;
+
+	if ((lease = find_lease_by_yiaddr(yiaddr)))
+		return !lease_expired(lease);
+	return (owner = lease_owner(yiaddr)) && owner->expires >= (unsigned long) time(0);
+}
+
+
+/* keep yiaddr from being handed out for a while, without a lease */
+void lease_reserve(uint32_t yiaddr, unsigned long seconds)
+{
+	struct lease_owner *owner;
+
+	if (!(owner = lease_owner(yiaddr))) return;
+	owner->lease = -1;
+	owner->expires = time(0) + seconds;
+	addr_pool_mark(&addr_pool, ADDR_USED, yiaddr, 1);
+	journal_reserve(yiaddr, owner->expires);
+	notify_reserve(yiaddr, owner->expires);
+}
+
+
+/* forget who holds a lease, keeping the address taken. It's left in
+ * its shard to be thrown away there */
+void lease_forget(struct dhcpOfferedAddr *lease)
+{
+	struct lease_owner *owner;
+
+	if (lease_current(lease) && (owner = lease_owner(lease->yiaddr))) {
+		owner->lease = -1;
+		owner->expires = lease->expires;
+		journal_reserve(lease->yiaddr, lease->expires);
+		notify_reserve(lease->yiaddr, lease->expires);
+	}
+}
+
+
+/* the client says someone else uses its address */
+void lease_decline(struct dhcpOfferedAddr *lease, unsigned long seconds)
+{
+	struct lease_shard *shard;
+	uint32_t yiaddr = lease->yiaddr;
+
+	if (!(shard = lease_shard_of(lease)) || !lease_current(lease))
+		return;
+	lease_free(&shard->index, lease);
+	lease_reserve(yiaddr, seconds);
+}
+
+
+void lease_set_expires(struct dhcpOfferedAddr *lease, uint32_t expires)
+{
+	struct lease_shard *shard;
+
+	if ((shard = lease_shard_of(lease)))
+		lease_index_set_expires(&shard->index, lease, expires);
+	else lease->expires = expires;
+	journal_lease(lease);
+	notify_lease(lease);
+}
+
+
+/* 1 if a record with chaddr was already put in seen, else put it there */
+static int chaddr_seen(int32_t *seen, uint32_t mask, struct dhcpOfferedAddr *records, int32_t n)
+{
+	uint32_t i;
+
+	for (i = lease_index_hash_chaddr(records[n].chaddr) & mask; seen[i] >= 0; i = (i + 1) & mask)
+		if (!memcmp(records[seen[i]].chaddr, records[n].chaddr, 16))
+			return 1;
+	seen[i] = n;
+	return 0;
+}
+
+
+/* Fill the empty table from the lease file, with lease_shards_lock()
+ * held. add_lease() per record cleared out the leases of the same
+ * chaddr or yiaddr first, so the last record of each wins. Going from
+ * the last record back, one whose chaddr or yiaddr was seen already is
+ * skipped, the rest are copied into the next free slot of their shard
+ * and the shards' indexes are built once at the end. Returns the
+ * records loaded, *full is set to those whose shard had no room. */
+uint32_t lease_load(struct dhcpOfferedAddr *records, uint32_t count, int remaining, uint32_t *full)
+{
+	struct dhcpOfferedAddr *lease;
+	struct lease_shard *shard;
+	struct lease_owner *owner;
+	uint32_t *fill, *ip_seen, mask = 15, n, off, loaded = 0;
+	uint32_t now = time(0), expires;
+	int32_t *mac_seen;
+	int dup;
+
+	*full = 0;
+	while (mask < count * 2) mask = mask * 2 + 1;
+	mac_seen = xmalloc((mask + 1) * sizeof(int32_t));
+	memset(mac_seen, 0xff, (mask + 1) * sizeof(int32_t));
+	ip_seen = xcalloc(lease_shards.size / 32 + 1, sizeof(uint32_t));
+	fill = xcalloc(lease_shards.count, sizeof(uint32_t));
+
+	for (n = count; n-- > 0;) {
+		/* ADDME: is it a static lease */
+		if (!(owner = lease_owner(records[n].yiaddr)))
+			continue;
+
+		/* a record hides older ones even if it doesn't fit itself */
+		off = owner - lease_shards.owner;
+		dup = (ip_seen[off / 32] >> off % 32) & 1;
+		ip_seen[off / 32] |= 1u << off % 32;
+		if (memcmp(records[n].chaddr, blank_chaddr, 16) &&
+		    chaddr_seen(mac_seen, mask, records, n))
+			dup = 1;
+		if (dup) continue;
+
+		expires = ntohl(records[n].expires);
+		if (remaining) expires += now;
+
+		/* a conflict or a declined address */
+		if (!memcmp(records[n].chaddr, blank_chaddr, 16)) {
+			owner->expires = expires;
+		} else {
+			shard = lease_shard(records[n].chaddr);
+			if (fill[shard - lease_shards.s] == shard->index.count) {
+				(*full)++;
+				continue;
+			}
+			lease = &shard->index.leases[fill[shard - lease_shards.s]++];
+			memcpy(lease->chaddr, records[n].chaddr, 16);
+			lease->yiaddr = records[n].yiaddr;
+			lease->expires = expires;
+			owner->lease = lease - leases;
+		}
+		addr_pool_mark(&addr_pool, ADDR_USED, records[n].yiaddr, 1);
+		loaded++;
+	}
+
+	for (n = 0; n < lease_shards.count; n++) {
+		shard = &lease_shards.s[n];
+		lease_index_init(&shard->index, shard->index.leases, shard->index.count);
+	}
+	free(fill);
+	free(ip_seen);
+	free(mac_seen);
+	return loaded;
 }
 
 
 /* check is an IP is taken, if it is, add it to the lease table */
 static int check_ip(uint32_t addr)
 {
-	struct in_addr temp;
+	/* sendOffer() probes it without blocking once the lease is reserved */
+	if (arp_probe_room()) return 0;
 
 	if (arpping(addr, server_config.server, server_config.arp, server_config.interface) == 0) {
-		temp.s_addr = addr;
-		LOG(LOG_INFO, "%s belongs to someone, reserving it for %ld seconds",
-			inet_ntoa(temp), server_config.conflict_time);
-		add_lease(blank_chaddr, addr, server_config.conflict_time);
+		arp_probe_conflict(addr);
 		return 1;
 	} else return 0;
 }
@@ -124,35 +323,36 @@ static int check_ip(uint32_t addr)
  * Maybe this should try expired leases by age... */
 uint32_t find_address(int check_expired)
 {
-	uint32_t addr, ret;
-	struct dhcpOfferedAddr *lease = NULL;
+	uint32_t addr;
 
-	addr = ntohl(server_config.start); /* addr is in host order here */
-	for (;addr <= ntohl(server_config.end); addr++) {
+	/* the bitmaps skip taken and reserved addresses a word at a time,
+	 * every address we turn down gets its bit set so this ends */
+	while ((addr = addr_pool_next_free(&addr_pool))) {
 
-		/* ie, 192.168.55.0 */
-		if (!(addr & 0xFF)) continue;
-
-		/* ie, 192.168.55.255 */
-		if ((addr & 0xFF) == 0xFF) continue;
+		/* the bitmap only knows the static leases it was told about */
+		if (reservedIp(server_config.static_leases, addr)) {
+			addr_pool_mark(&addr_pool, ADDR_RESERVED, addr, 1);
+			continue;
+		}
 
-		/* Only do if it isn't an assigned as a static lease */
-		if(!reservedIp(server_config.static_leases, htonl(addr)))
-		{
+		/* and it isn't on the network */
+		if (!check_ip(addr)) return addr;
+	}
 
-		/* lease is not taken */
-		ret = htonl(addr);
-		if ((!(lease = find_lease_by_yiaddr(ret)) ||
+	if (!check_expired) return 0;
 
-		     /* or it expired and we are checking for expired leases */
-		     (check_expired  && lease_expired(lease))) &&
+	/* nothing free, try the expired leases and the old conflicts */
+	for (addr = 0; (addr = addr_pool_next_taken(&addr_pool, addr));) {
+		if (lease_taken(addr))
+			continue;
 
-		     /* and it isn't on the network */
-	    	     !check_ip(ret)) {
-			return ret;
-			break;
+		if (reservedIp(server_config.static_leases, addr)) {
+			addr_pool_mark(&addr_pool, ADDR_RESERVED, addr, 1);
+			continue;
 		}
-	}
+
+		addr_pool_mark(&addr_pool, ADDR_CONFLICT, addr, 0);
+		if (!check_ip(addr)) return addr;
 	}
 	return 0;
 }
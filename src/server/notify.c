@@ -0,0 +1,348 @@
+/*
+ * notify.c -- telling the outside world about leases
+ *
+ * Every lease file write used to end in system("notify_file lease_file"),
+ * built in a 255 byte buffer, and nothing else was written until the
+ * script exited. notify_file is now started with posix_spawnp() from the
+ * event loop and reaped when its pidfd says it exited. Lease files
+ * written while it runs are coalesced into one more run afterwards,
+ * so a slow script only sees fewer, newer files.
+ *
+ * For consumers that want each change as it happens, notify_socket
+ * names a unix stream socket they listen on. Every change the journal
+ * records is queued and a thread of its own writes it out as a line:
+ *
+ *	lease 00:11:22:33:44:55 192.168.0.20 1700000000
+ *	reserve 192.168.0.21 1700000000
+ *	dropped 12
+ *
+ * Times are absolute. The queue is bounded, a reader that is slow or
+ * away costs "dropped" lines, never a stalled worker. The server
+ * connects again every few seconds after losing the reader.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/journal.h"
+#include "udhcp/notify.h"
+
+#define RETRY_MAX	30	/* seconds between tries to reach the reader, at most */
+#define LINE_MAX_LEN	64	/* "lease" line with the longest MAC and address */
+#define SEND_BATCH	4096
+
+extern char **environ;
+
+struct notify_t notify;
+
+static struct event_loop *loop;
+
+/* notify_file, only touched from the event loop */
+static int wake = -1;
+static int written;		/* a lease file was written before notify_open() */
+static pid_t hook_pid;
+static int hook_fd = -1;	/* its pidfd, -1 if it is reaped at the next run */
+static int hook_again;		/* another lease file was written while it ran */
+
+/* the reader of notify_socket */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sender;
+static int running, sock = -1;
+static struct journal_record *queue;	/* in network order, as in the journal */
+static uint32_t head, tail, dropped;	/* head - tail events are queued */
+
+
+static void hook_run(void);
+
+static void hook_exited(int fd, void *arg)
+{
+	int status;
+
+	event_del(loop, fd);
+	close(fd);
+	hook_fd = -1;
+	if (waitpid(hook_pid, &status, 0) == hook_pid &&
+	    (!WIFEXITED(status) || WEXITSTATUS(status)))
+		LOG(LOG_WARNING, "%s failed with status %d", server_config.notify_file, status);
+	hook_pid = 0;
+
+	if (hook_again) {
+		hook_again = 0;
+		hook_run();
+	}
+}
+
+
+static void hook_run(void)
+{
+	char *argv[] = {server_config.notify_file, server_config.lease_file, NULL};
+	int err;
+
+	/* without a pidfd the last one is reaped here */
+	if (hook_pid && hook_fd < 0 && waitpid(hook_pid, NULL, WNOHANG) == hook_pid)
+		hook_pid = 0;
+	if (hook_pid) {
+		hook_again = 1;
+		return;
+	}
+
+	if ((err = posix_spawnp(&hook_pid, argv[0], NULL, NULL, argv, environ))) {
+		LOG(LOG_ERR, "Unable to run %s, %s", argv[0], strerror(err));
+		hook_pid = 0;
+		return;
+	}
+#ifdef SYS_pidfd_open
+	if (!loop || (hook_fd = syscall(SYS_pidfd_open, hook_pid, 0)) < 0)
+		return;
+	if (event_add(loop, hook_fd, hook_exited, NULL) < 0) {
+		close(hook_fd);
+		hook_fd = -1;
+	}
+#endif
+}
+
+
+static void snapshot_written(int fd, void *arg)
+{
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) == sizeof(n))
+		hook_run();
+}
+
+
+void notify_snapshot(void)
+{
+	uint64_t one = 1;
+
+	if (!server_config.notify_file) return;
+	if (wake < 0) written = 1;
+	else if (write(wake, &one, sizeof(one)) < 0)
+		DEBUG(LOG_ERR, "Could not wake notify_file: %m");
+}
+
+
+static void push(uint8_t type, uint32_t yiaddr, uint32_t expires, uint8_t *chaddr)
+{
+	struct journal_record *rec;
+
+	if (!queue) return;
+
+	pthread_mutex_lock(&lock);
+	if (head - tail == notify.queue)
+		dropped++;
+	else {
+		rec = &queue[head++ % notify.queue];
+		rec->type = type;
+		rec->yiaddr = yiaddr;
+		rec->expires = htonl(expires);
+		if (chaddr) memcpy(rec->chaddr, chaddr, 16);
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+void notify_lease(struct dhcpOfferedAddr *lease)
+{
+	push(JOURNAL_LEASE, lease->yiaddr, lease->expires, lease->chaddr);
+}
+
+
+void notify_reserve(uint32_t yiaddr, uint32_t expires)
+{
+	push(JOURNAL_RESERVE, yiaddr, expires, NULL);
+}
+
+
+static int format(char *buf, struct journal_record *rec)
+{
+	char ip[INET_ADDRSTRLEN];
+	uint8_t *c = rec->chaddr;
+
+	inet_ntop(AF_INET, &rec->yiaddr, ip, sizeof(ip));
+	if (rec->type == JOURNAL_RESERVE)
+		return sprintf(buf, "reserve %s %u\n", ip, ntohl(rec->expires));
+	return sprintf(buf, "lease %02x:%02x:%02x:%02x:%02x:%02x %s %u\n",
+		       c[0], c[1], c[2], c[3], c[4], c[5], ip, ntohl(rec->expires));
+}
+
+
+/* connected to the reader, -1 if it isn't listening. Not blocking on
+ * a full backlog, writes block as the thread is there to wait */
+static int reader_connect(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, notify.socket, sizeof(addr.sun_path) - 1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    fcntl(fd, F_SETFL, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+static int send_all(int fd, char *buf, int len)
+{
+	ssize_t n;
+
+	while (len) {
+		if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+static void *sender_run(void *arg)
+{
+	char buf[SEND_BATCH + LINE_MAX_LEN];
+	struct timespec until;
+	uint32_t events, retry = 1;
+	int fd, len;
+
+	pthread_mutex_lock(&lock);
+	while (running) {
+		if (head == tail && !dropped) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+
+		if (sock < 0) {
+			pthread_mutex_unlock(&lock);
+			fd = reader_connect();
+			pthread_mutex_lock(&lock);
+			/* notify_close() found no socket to shut down */
+			if (!running) {
+				if (fd >= 0) close(fd);
+				break;
+			}
+			if (fd < 0) {
+				/* what comes meanwhile waits in the queue */
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_sec += retry;
+				if ((retry *= 2) > RETRY_MAX) retry = RETRY_MAX;
+				pthread_cond_timedwait(&cond, &lock, &until);
+				continue;
+			}
+			sock = fd;
+			retry = 1;
+			LOG(LOG_INFO, "Sending lease events to %s", notify.socket);
+		}
+
+		len = 0;
+		if (dropped) {
+			len = sprintf(buf, "dropped %u\n", dropped);
+			dropped = 0;
+		}
+		for (events = 0; tail != head && len < SEND_BATCH; events++)
+			len += format(buf + len, &queue[tail++ % notify.queue]);
+		fd = sock;
+		pthread_mutex_unlock(&lock);
+
+		if (send_all(fd, buf, len) < 0) {
+			pthread_mutex_lock(&lock);
+			if (running)
+				LOG(LOG_WARNING, "Lost the reader of %s, %m", notify.socket);
+			close(sock);
+			sock = -1;
+			dropped += events;
+			continue;
+		}
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+
+int notify_open(struct event_loop *event_loop)
+{
+	loop = event_loop;
+	if (server_config.notify_file) {
+		if ((wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+		    event_add(loop, wake, snapshot_written, NULL) < 0) {
+			LOG(LOG_ERR, "Could not watch for lease file writes, %m");
+			return -1;
+		}
+		/* the one read_leases() was followed by */
+		if (written) notify_snapshot();
+	}
+
+	if (!notify.socket) return 0;
+	if (!notify.queue) notify.queue = 1;
+	queue = xcalloc(notify.queue, sizeof(struct journal_record));
+	running = 1;
+	if (pthread_create(&sender, NULL, sender_run, NULL)) {
+		LOG(LOG_ERR, "Could not start sending lease events");
+		free(queue);
+		queue = NULL;
+		running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
+void notify_close(void)
+{
+	uint64_t n;
+
+	if (queue) {
+		pthread_mutex_lock(&lock);
+		running = 0;
+		/* a send blocked on the reader returns */
+		if (sock >= 0) shutdown(sock, SHUT_RDWR);
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&lock);
+		pthread_join(sender, NULL);
+		if (sock >= 0) close(sock);
+		sock = -1;
+		free(queue);
+		queue = NULL;
+	}
+
+	if (wake < 0) return;
+	/* the last lease file gets its run after the one still going, so
+	 * two never work on the file at once. Nobody waits for the last */
+	if (hook_fd >= 0) {
+		event_del(loop, hook_fd);
+		close(hook_fd);
+		hook_fd = -1;
+	}
+	event_del(loop, wake);
+	loop = NULL;
+	if (read(wake, &n, sizeof(n)) == sizeof(n) || hook_again) {
+		if (hook_pid) waitpid(hook_pid, NULL, 0);
+		hook_pid = 0;
+		hook_run();
+	}
+	close(wake);
+	wake = -1;
+}
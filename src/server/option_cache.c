@@ -0,0 +1,211 @@
+/*
+ * option_cache.c -- precompiled DHCPsql options, one blob per class
+ *
+ * Every OFFER and ACK used to run the options UNION query and parse
+ * the text of each row with add_option_row(). The options table hardly
+ * ever changes, so each class is compiled once into the wire format
+ * (its own rows plus the class 0 defaults, ordered by code), and then
+ * into a reply template, so a packet only needs a memcpy.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <mysql.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/options.h"
+#include "udhcp/option_builder.h"
+#include "udhcp/common.h"
+#include "udhcp/db_query.h"
+#include "udhcp/option_cache.h"
+#include "udhcp/reply_template.h"
+
+struct option_blob {
+	int32_t class;
+	int count;		/* options in data */
+	int len;
+	uint8_t *data;		/* code/length/data triplets, no DHCP_END */
+	struct reply_template template;	/* data behind the reply header */
+};
+
+struct option_row {
+	int32_t class;
+	uint8_t code;
+	char *data;
+};
+
+struct option_rows {
+	struct option_row *row;
+	int count, size;
+};
+
+struct option_cache_t option_cache;
+
+static struct option_blob *blobs;	/* sorted by class */
+static int blobs_count;
+/* workers copy blobs without holding server_lock */
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+static void read_row(int32_t class, uint8_t code, char *data, void *arg)
+{
+	struct option_rows *rows = arg;
+
+	if (rows->count == rows->size) {
+		rows->size = rows->size ? rows->size * 2 : 64;
+		rows->row = xrealloc(rows->row, rows->size * sizeof(struct option_row));
+	}
+	rows->row[rows->count].class = class;
+	rows->row[rows->count].code = code;
+	rows->row[rows->count].data = xstrdup(data);
+	rows->count++;
+}
+
+
+static void free_rows(struct option_rows *rows)
+{
+	int i;
+
+	for (i = 0; i < rows->count; i++)
+		free(rows->row[i].data);
+	free(rows->row);
+}
+
+
+static void free_blobs(struct option_blob *list, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		free(list[i].data);
+	free(list);
+}
+
+
+static int compare_class(const void *a, const void *b)
+{
+	const struct option_blob *x = a, *y = b;
+
+	return (x->class > y->class) - (x->class < y->class);
+}
+
+
+/* compile class plus the class 0 rows, rows are ordered by code.
+ * Identical code/data pairs only go in once, as the UNION did */
+static void compile_class(struct option_blob *blob, struct option_rows *rows, int32_t class)
+{
+	uint8_t scratch[308];
+	char code[4], data[256];
+	char *row[2];
+	int i, j, dup;
+
+	scratch[0] = DHCP_END;
+	blob->class = class;
+	blob->count = 0;
+	row[0] = code;
+	row[1] = data;
+
+	for (i = 0; i < rows->count; i++) {
+		if (rows->row[i].class != class && rows->row[i].class != 0)
+			continue;
+
+		for (dup = 0, j = i - 1; j >= 0 && rows->row[j].code == rows->row[i].code; j--)
+			if ((rows->row[j].class == class || rows->row[j].class == 0) &&
+			    !strcmp(rows->row[j].data, rows->row[i].data))
+				dup = 1;
+		if (dup) continue;
+
+		/* add_option_row() tokenizes the data in place */
+		snprintf(code, sizeof(code), "%u", rows->row[i].code);
+		strncpy(data, rows->row[i].data, sizeof(data) - 1);
+		data[sizeof(data) - 1] = '\0';
+		add_option_row(scratch, row);
+		blob->count++;
+	}
+
+	blob->len = end_option(scratch);
+	blob->data = xmalloc(blob->len ? blob->len : 1);
+	memcpy(blob->data, scratch, blob->len);
+	/* the database path never added the bootp fields */
+	reply_template_build(&blob->template, blob->data, blob->len, 0);
+}
+
+
+int option_cache_refresh(int force)
+{
+	struct option_rows rows;
+	struct option_blob *list;
+	uint32_t count, sum;
+	int i, j, n;
+
+	if (db_options_fingerprint(&count, &sum) < 0) {
+		LOG(LOG_WARNING, "Could not check options, keeping the compiled copy");
+		return -1;
+	}
+
+	if (!force && option_cache.loaded &&
+	    count == option_cache.rows && sum == option_cache.sum)
+		return 0;
+
+	memset(&rows, 0, sizeof(rows));
+	if (db_foreach_option(read_row, &rows) < 0) {
+		LOG(LOG_WARNING, "Could not read options, keeping the compiled copy");
+		free_rows(&rows);
+		return -1;
+	}
+
+	/* one blob for class 0 and every other class that has rows */
+	list = xcalloc(rows.count + 1, sizeof(struct option_blob));
+	n = 0;
+	compile_class(&list[n++], &rows, 0);
+	for (i = 0; i < rows.count; i++) {
+		for (j = 0; j < n && list[j].class != rows.row[i].class; j++);
+		if (j == n) compile_class(&list[n++], &rows, rows.row[i].class);
+	}
+	qsort(list, n, sizeof(struct option_blob), compare_class);
+	free_rows(&rows);
+
+	pthread_rwlock_wrlock(&cache_lock);
+	free_blobs(blobs, blobs_count);
+	blobs = list;
+	blobs_count = n;
+
+	option_cache.rows = count;
+	option_cache.sum = sum;
+	option_cache.loaded = 1;
+	pthread_rwlock_unlock(&cache_lock);
+	LOG(LOG_INFO, "Option cache: %u rows compiled into %d classes", count, n);
+	return n;
+}
+
+
+int option_cache_reply(struct dhcpMessage *packet, struct option_builder *opts, int32_t class)
+{
+	struct option_blob key, *blob;
+	int count;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	if (!option_cache.loaded) {
+		pthread_rwlock_unlock(&cache_lock);
+		return -1;
+	}
+
+	key.class = class;
+
+	/* a class without rows of its own only gets the defaults */
+	if (!(blob = bsearch(&key, blobs, blobs_count, sizeof(struct option_blob), compare_class))) {
+		key.class = 0;
+		blob = bsearch(&key, blobs, blobs_count, sizeof(struct option_blob), compare_class);
+	}
+	if (!blob || !blob->count) {
+		pthread_rwlock_unlock(&cache_lock);
+		return 0;
+	}
+
+	reply_template_copy(packet, opts, &blob->template);
+	count = blob->count;
+	pthread_rwlock_unlock(&cache_lock);
+	return count;
+}
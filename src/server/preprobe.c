@@ -0,0 +1,173 @@
+/*
+ * preprobe.c -- keep a few free addresses ARP checked ahead of time
+ *
+ * Even without blocking, the first OFFER to a new client waits for its
+ * probe to time out. The pre-prober probes free addresses in the
+ * background, at most rate per second, and keeps up to count of the
+ * ones nobody answered for so sendOffer() can hand them out at once.
+ * Addresses it holds are marked ADDR_PROBED so find_address() leaves
+ * them alone.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/static_leases.h"
+#include "udhcp/addr_pool.h"
+#include "udhcp/arp_probe.h"
+#include "udhcp/preprobe.h"
+#include "udhcp/lease_shard.h"
+
+#define PREPROBE_RETRY	5	/* seconds before looking again in an exhausted pool */
+
+struct preprobe_addr {
+	uint32_t yiaddr;
+	time_t when;		/* probe deadline, or when it was found free */
+};
+
+struct preprobe_t preprobe;
+
+static struct preprobe_addr *probing, *ready;	/* ready is oldest first */
+static uint32_t probing_count, ready_count;
+static time_t rate_second, idle_until;
+static uint32_t rate_used;
+
+
+void preprobe_init(void)
+{
+	if (!preprobe.count || arp_probe_fd() < 0) {
+		preprobe.count = 0;
+		return;
+	}
+	if (!preprobe.rate) preprobe.rate = 1;
+
+	probing = xcalloc(preprobe.count, sizeof(struct preprobe_addr));
+	ready = xcalloc(preprobe.count, sizeof(struct preprobe_addr));
+}
+
+
+static void drop(struct preprobe_addr *list, uint32_t *count, uint32_t i)
+{
+	addr_pool_mark(&addr_pool, ADDR_PROBED, list[i].yiaddr, 0);
+	memmove(&list[i], &list[i + 1], (--*count - i) * sizeof(struct preprobe_addr));
+}
+
+
+uint32_t preprobe_take(void)
+{
+	uint32_t addr;
+	time_t now = time(0);
+
+	while (ready_count) {
+		addr = ready[0].yiaddr;
+		if (ready[0].when + PREPROBE_MAX_AGE <= now) {
+			drop(ready, &ready_count, 0);
+			continue;
+		}
+		drop(ready, &ready_count, 0);
+
+		/* a requested ip or a new static lease may have claimed it since */
+		if (lease_taken(addr) || reservedIp(server_config.static_leases, addr))
+			continue;
+		return addr;
+	}
+	return 0;
+}
+
+
+int preprobe_reply(uint32_t yiaddr)
+{
+	uint32_t i;
+
+	for (i = 0; i < probing_count; i++)
+		if (probing[i].yiaddr == yiaddr) {
+			drop(probing, &probing_count, i);
+			arp_probe_conflict(yiaddr);
+			return 1;
+		}
+
+	for (i = 0; i < ready_count; i++)
+		if (ready[i].yiaddr == yiaddr) {
+			drop(ready, &ready_count, i);
+			arp_probe_conflict(yiaddr);
+			return 1;
+		}
+	return 0;
+}
+
+
+void preprobe_run(void)
+{
+	time_t now = time(0);
+	uint32_t addr, i;
+
+	if (!preprobe.count) return;
+
+	/* nobody answered in time, the address is free */
+	for (i = 0; i < probing_count;) {
+		if (probing[i].when > now) {
+			i++;
+			continue;
+		}
+		ready[ready_count].yiaddr = probing[i].yiaddr;
+		ready[ready_count++].when = now;
+		memmove(&probing[i], &probing[i + 1], (--probing_count - i) * sizeof(struct preprobe_addr));
+	}
+
+	/* too old to trust, give them back */
+	while (ready_count && ready[0].when + PREPROBE_MAX_AGE <= now)
+		drop(ready, &ready_count, 0);
+
+	if (rate_second != now) {
+		rate_second = now;
+		rate_used = 0;
+	}
+
+	while (ready_count + probing_count < preprobe.count && rate_used < preprobe.rate &&
+	       idle_until <= now) {
+		if (!(addr = addr_pool_next_free(&addr_pool))) {
+			idle_until = now + PREPROBE_RETRY;
+			break;
+		}
+		if (reservedIp(server_config.static_leases, addr)) {
+			addr_pool_mark(&addr_pool, ADDR_RESERVED, addr, 1);
+			continue;
+		}
+		if (arp_probe_send(addr) < 0) {
+			idle_until = now + PREPROBE_RETRY;
+			break;
+		}
+
+		addr_pool_mark(&addr_pool, ADDR_PROBED, addr, 1);
+		probing[probing_count].yiaddr = addr;
+		probing[probing_count++].when = now + ARP_PROBE_TIMEOUT;
+		rate_used++;
+	}
+}
+
+
+time_t preprobe_deadline(void)
+{
+	time_t deadline = 0;
+	uint32_t i;
+
+	if (!preprobe.count) return 0;
+
+	for (i = 0; i < probing_count; i++)
+		if (!deadline || probing[i].when < deadline)
+			deadline = probing[i].when;
+
+	if (ready_count && (!deadline || ready[0].when + PREPROBE_MAX_AGE < deadline))
+		deadline = ready[0].when + PREPROBE_MAX_AGE;
+
+	/* room to fill, once the rate or the empty pool allows */
+	if (ready_count + probing_count < preprobe.count) {
+		time_t next = idle_until > rate_second ? idle_until : rate_second + 1;
+
+		if (!deadline || next < deadline)
+			deadline = next;
+	}
+	return deadline;
+}
@@ -0,0 +1,91 @@
+/*
+ * reply_template.c -- OFFER/ACK packets built ahead of time
+ *
+ * Every OFFER and ACK used to be built from an empty packet, walking
+ * the server_config.options list and adding one option at a time
+ * before the bootp fields. All of that is the same for every client
+ * of the pool, or of a DHCPsql option class, so it is built once into
+ * a template and a reply is a memcpy and a few stores.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/options.h"
+#include "udhcp/common.h"
+#include "udhcp/reply_template.h"
+
+struct reply_template reply_template, reply_template_bare;
+
+
+void reply_template_build(struct reply_template *t, uint8_t *options, int len, int bootp)
+{
+	struct option_builder opts;
+	int i;
+
+	init_header(&t->packet, DHCPOFFER);
+	option_builder_init(&opts, t->packet.options);
+	/* placeholders at TEMPLATE_SERVER_ID and TEMPLATE_LEASE */
+	option_builder_simple(&opts, DHCP_SERVER_ID, 0);
+	option_builder_simple(&opts, DHCP_LEASE_TIME, 0);
+
+	for (i = 0; i < len; i += options[i + OPT_LEN] + 2)
+		if (options[i + OPT_CODE] != DHCP_LEASE_TIME)
+			option_builder_add(&opts, options + i);
+	t->end = opts.end;
+
+	if (!bootp) return;
+	t->packet.siaddr = server_config.siaddr;
+	if (server_config.sname)
+		strncpy(t->packet.sname, server_config.sname, sizeof(t->packet.sname) - 1);
+	if (server_config.boot_file)
+		strncpy(t->packet.file, server_config.boot_file, sizeof(t->packet.file) - 1);
+}
+
+
+void reply_templates_init(void)
+{
+	struct option_builder opts;
+	struct option_set *curr;
+	uint8_t options[308];
+
+	/* the option list flattened the way the reply functions added it */
+	options[0] = DHCP_END;
+	option_builder_init(&opts, options);
+	for (curr = server_config.options; curr; curr = curr->next)
+		if (curr->data[OPT_CODE] != DHCP_LEASE_TIME)
+			option_builder_add(&opts, curr->data);
+
+	reply_template_build(&reply_template, options, opts.end, 1);
+	reply_template_build(&reply_template_bare, NULL, 0, 0);
+}
+
+
+void reply_template_copy(struct dhcpMessage *packet, struct option_builder *opts,
+			 struct reply_template *t)
+{
+	memcpy(packet, &t->packet, sizeof(struct dhcpMessage));
+	opts->options = packet->options;
+	opts->end = t->end;
+	opts->size = sizeof(packet->options);
+}
+
+
+void reply_template_patch(struct dhcpMessage *packet, struct dhcpMessage *oldpacket, char type)
+{
+	packet->xid = oldpacket->xid;
+	memcpy(packet->chaddr, oldpacket->chaddr, 16);
+	packet->flags = oldpacket->flags;
+	packet->giaddr = oldpacket->giaddr;
+	packet->ciaddr = oldpacket->ciaddr;
+	packet->options[TEMPLATE_TYPE] = type;
+	memcpy(packet->options + TEMPLATE_SERVER_ID, &server_config.server, 4);
+}
+
+
+void reply_template_lease(struct dhcpMessage *packet, uint32_t lease)
+{
+	lease = htonl(lease);
+	memcpy(packet->options + TEMPLATE_LEASE, &lease, 4);
+}
@@ -0,0 +1,44 @@
+/*
+ * request.c -- per packet state of the server
+ *
+ * The main loop, sendOffer() and the option lookup all need to know
+ * whether the client has a static lease. It is resolved once when the
+ * packet comes in instead of by each of them.
+ */
+
+#include <string.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/static_leases.h"
+#include "udhcp/request.h"
+#ifdef DHCPsql
+#include "udhcp/db_query.h"
+#include "udhcp/static_cache.h"
+#endif
+
+
+void request_init(struct dhcp_request *req, struct dhcpMessage *packet, struct option_index *idx)
+{
+	req->packet = packet;
+	req->static_ip = 0;
+	req->class = -1;
+	req->probed = 0;
+	memcpy(&req->options, idx, sizeof(struct option_index));
+
+#ifdef DHCPsql
+	/* the database is only asked until the cache has been loaded */
+	if (static_cache_lookup(packet->chaddr, &req->static_ip, &req->class) < 0 &&
+	    db_ip_by_mac(packet->chaddr, &req->static_ip, &req->class) <= 0) {
+		req->static_ip = 0;
+		req->class = -1;
+	}
+#else
+	req->static_ip = getIpByMac(server_config.static_leases, packet->chaddr);
+#endif
+}
+
+
+uint8_t *request_option(struct dhcp_request *req, int code)
+{
+	return option_index_get(&req->options, req->packet, code);
+}
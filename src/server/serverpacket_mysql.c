@@ -31,16 +31,25 @@
 #include "udhcp/serverpacket.h"
 #include "udhcp/dhcpd.h"
 #include "udhcp/options.h"
+#include "udhcp/option_builder.h"
+#include "udhcp/reply_template.h"
 #include "udhcp/common.h"
 #include "udhcp/static_leases.h"
+#include "udhcp/db_query.h"
+#include "udhcp/option_cache.h"
+#include "udhcp/request.h"
+#include "udhcp/arp_probe.h"
+#include "udhcp/preprobe.h"
+#include "udhcp/packet_batch.h"
+#include "udhcp/lease_shard.h"
+#include "udhcp/worker.h"
 
 /* send a packet to giaddr using the kernel ip stack */
 static int send_packet_to_relay(struct dhcpMessage *payload)
 {
 	DEBUG(LOG_INFO, "Forwarding packet to relay");
 
-	return kernel_packet(payload, server_config.server, SERVER_PORT,
-			payload->giaddr, SERVER_PORT);
+	return queue_kernel_packet(tx_queue, payload, payload->giaddr, SERVER_PORT);
 }
 
 
@@ -67,8 +76,7 @@ static int send_packet_to_client(struct dhcpMessage *payload, int force_broadcas
 		ciaddr = payload->yiaddr;
 		chaddr = payload->chaddr;
 	}
-	return raw_packet(payload, server_config.server, SERVER_PORT,
-			ciaddr, CLIENT_PORT, chaddr, server_config.ifindex);
+	return queue_raw_packet(tx_queue, payload, ciaddr, CLIENT_PORT, chaddr);
 }
 
 
@@ -84,7 +92,8 @@ static int send_packet(struct dhcpMessage *payload, int force_broadcast)
 }
 
 
-static void init_packet(struct dhcpMessage *packet, struct dhcpMessage *oldpacket, char type)
+static void init_packet(struct dhcpMessage *packet, struct option_builder *opts,
+			struct dhcpMessage *oldpacket, char type)
 {
 	init_header(packet, type);
 	packet->xid = oldpacket->xid;
@@ -92,7 +101,8 @@ static void init_packet(struct dhcpMessage *packet, struct dhcpMessage *oldpacke
 	packet->flags = oldpacket->flags;
 	packet->giaddr = oldpacket->giaddr;
 	packet->ciaddr = oldpacket->ciaddr;
-	add_simple_option(packet->options, DHCP_SERVER_ID, server_config.server);
+	option_builder_init(opts, packet->options);
+	option_builder_simple(opts, DHCP_SERVER_ID, server_config.server);
 }
 
 
@@ -107,88 +117,66 @@ static void add_bootp_options(struct dhcpMessage *packet)
 }
 
 
-static int add_mysql_options(struct dhcpMessage *packet, void *arg)
+/* start a reply from the template of req's class. Before the option
+ * cache is loaded the database adds the class options to a bare one, a
+ * class without options gets the udhcpd.conf ones */
+static void init_reply(struct dhcpMessage *packet, struct option_builder *opts,
+		       struct dhcp_request *req, char type, uint32_t yiaddr)
 {
-	int return_value;
-
-	char query[512];
-
-	uint8_t *mac = arg;
-
-	MYSQL *conn;
-	MYSQL_RES *res;
-	MYSQL_ROW row;
-
-	return_value = 0;
-
-	conn = mysql_init(NULL);
-
-	/* Connect to database */
-	if (!mysql_real_connect(conn, server_config.dbserver, server_config.user, server_config.password, server_config.database, 0, NULL, 0)) {
-		fprintf(stderr, "%s\n", mysql_error(conn));
-		return 0;
-        }
-	if (server_config.table_efficient)
-		snprintf(query, 512, "SELECT * FROM (SELECT code, data FROM %s, %s WHERE %s.class = %s.class AND mac = 0x%02x%02x%02x%02x%02x%02x UNION SELECT code, data FROM %s WHERE class = 0) AS x ORDER BY code", server_config.table_staticleases, server_config.table_options, server_config.table_staticleases, server_config.table_options, mac[0],mac[1],mac[2],mac[3],mac[4],mac[5], server_config.table_options);
-	else
-		snprintf(query, 512, "SELECT * FROM (SELECT code, data FROM %s, %s WHERE %s.class = %s.class AND LOWER(mac) = \"%02x%02x%02x%02x%02x%02x\" UNION SELECT code, data FROM %s WHERE class = 0) AS x ORDER BY code", server_config.table_staticleases, server_config.table_options, server_config.table_staticleases, server_config.table_options, mac[0],mac[1],mac[2],mac[3],mac[4],mac[5], server_config.table_options);
-#ifdef UDHCP_DEBUG
-	printf("%s\n", query);
-#endif
-
-	/* send SQL query */
-	if (mysql_query(conn, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conn));
-		return_value = 0;
-        } else {
-		res = mysql_use_result(conn);
-
-		while ((row = mysql_fetch_row(res)) != NULL) {
-			add_option_row(packet->options, row);
-			/* iets van een wrapper functie make die controleert
-			 * of het volgende regeltje de zelfde option bevat
-			 * als deze optie een list mag zijn, dan appenden
-			 * geen list, dan vervangen
-			 * nieuwe optie, dan toevoegen*/
-			return_value = 1;
-		}
-
-		mysql_free_result(res);
-
+	/* iets van een wrapper functie make die controleert
+	 * of het volgende regeltje de zelfde option bevat
+	 * als deze optie een list mag zijn, dan appenden
+	 * geen list, dan vervangen
+	 * nieuwe optie, dan toevoegen*/
+	int added;
+
+	if ((added = option_cache_reply(packet, opts, req->class)) < 0) {
+		reply_template_copy(packet, opts, &reply_template_bare);
+		/* the rows are added straight into the field */
+		added = db_add_class_options(opts->options, req->class);
+		option_builder_sync(opts);
 	}
-	
-	mysql_close(conn);
-
-	return return_value;
+	if (added <= 0) reply_template_copy(packet, opts, &reply_template);
+	reply_template_patch(packet, req->packet, type);
+	packet->yiaddr = yiaddr;
 }
 
+
 /* send a DHCP OFFER to a DHCP DISCOVER */
-int sendOffer(struct dhcpMessage *oldpacket)
+int sendOffer(struct dhcp_request *request)
 {
+	struct dhcpMessage *oldpacket = request->packet;
 	struct dhcpMessage packet;
+	struct option_builder opts;
 	struct dhcpOfferedAddr *lease = NULL;
 	uint32_t req_align, lease_time_align = server_config.lease;
 	uint8_t *req, *lease_time;
-	struct option_set *curr;
 	struct in_addr addr;
+	int probe = 0;
 
-	uint32_t static_lease_ip;
+	uint32_t static_lease_ip = request->static_ip;
 
-	init_packet(&packet, oldpacket, DHCPOFFER);
+	/* picking the address needs the pool, the caller holds chaddr's shard */
+	pthread_mutex_lock(&server_lock);
 
-	static_lease_ip = getIpByMac(server_config.static_leases, oldpacket->chaddr);
+	/* the OFFER for an earlier DISCOVER goes out when its probe ends */
+	if (!request->probed && arp_probe_pending(oldpacket->chaddr)) {
+		pthread_mutex_unlock(&server_lock);
+		return 0;
+	}
 
 	/* ADDME: if static, short circuit */
 	if(!static_lease_ip)
 	{
 	/* the client is in our lease/offered table */
 	if ((lease = find_lease_by_chaddr(oldpacket->chaddr))) {
-		if (!lease_expired(lease))
+		/* unless we reserved it ourselves before probing */
+		if (!lease_expired(lease) && !request->probed)
 			lease_time_align = lease->expires - time(0);
 		packet.yiaddr = lease->yiaddr;
 
 	/* Or the client has a requested ip */
-	} else if ((req = get_option(oldpacket, DHCP_REQUESTED_IP)) &&
+	} else if ((req = request_option(request, DHCP_REQUESTED_IP)) &&
 
 		   /* Don't look here (ugly hackish thing to do) */
 		   memcpy(&req_align, req, 4) &&
@@ -199,32 +187,42 @@ int sendOffer(struct dhcpMessage *oldpacket)
 		
 			!static_lease_ip &&  /* Check that its not a static lease */
 			/* and is not already taken/offered */
-		   ((!(lease = find_lease_by_yiaddr(req_align)) ||
-		
 		   /* or its taken, but expired */ /* ADDME: or maybe in here */
-		   lease_expired(lease)))) {
+		   !lease_taken(req_align)) {
 				packet.yiaddr = req_align; /* FIXME: oh my, is there a host using this IP? */
 
 			/* otherwise, find a free IP */
-	} else {
+	/* or one the pre-prober already found free */
+	} else if (!(packet.yiaddr = preprobe_take())) {
 			/* Is it a static lease? (No, because find_address skips static lease) */
 		packet.yiaddr = find_address(0);
 
 		/* try for an expired lease */
 		if (!packet.yiaddr) packet.yiaddr = find_address(1);
+		probe = 1;
 	}
 
 	if(!packet.yiaddr) {
+		pthread_mutex_unlock(&server_lock);
 		LOG(LOG_WARNING, "no IP addresses to give -- OFFER abandoned");
 		return -1;
 	}
 
-	if (!add_lease(packet.chaddr, packet.yiaddr, server_config.offer_time)) {
+	if (!add_lease(oldpacket->chaddr, packet.yiaddr, server_config.offer_time)) {
+		pthread_mutex_unlock(&server_lock);
 		LOG(LOG_WARNING, "lease pool is full -- OFFER abandoned");
 		return -1;
 	}
 
-	if ((lease_time = get_option(oldpacket, DHCP_LEASE_TIME))) {
+	/* find_address() left the ARP check to the async prober, which
+	 * calls us again once it knows the address is free */
+	if (probe && arp_probe_start(request, packet.yiaddr) == 0) {
+		pthread_mutex_unlock(&server_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&server_lock);
+
+	if ((lease_time = request_option(request, DHCP_LEASE_TIME))) {
 		memcpy(&lease_time_align, lease_time, 4);
 		lease_time_align = ntohl(lease_time_align);
 		if (lease_time_align > server_config.lease)
@@ -238,24 +236,15 @@ int sendOffer(struct dhcpMessage *oldpacket)
 	/* ADDME: end of short circuit */
 	else
 	{
+		pthread_mutex_unlock(&server_lock);
 		/* It is a static lease... use it */
 		packet.yiaddr = static_lease_ip;
 	}
 
-
-	add_simple_option(packet.options, DHCP_LEASE_TIME, htonl(lease_time_align));
-	
-	if (!add_mysql_options(&packet, oldpacket->chaddr)) {
-	
-		curr = server_config.options;
-		while (curr) {
-			if (curr->data[OPT_CODE] != DHCP_LEASE_TIME)
-				add_option_string(packet.options, curr->data);
-			curr = curr->next;
-		}
-
-		add_bootp_options(&packet);
-	}
+	/* the class options may need the database, so the reply is only
+	 * started now that the address is picked and server_lock dropped */
+	init_reply(&packet, &opts, request, DHCPOFFER, packet.yiaddr);
+	reply_template_lease(&packet, lease_time_align);
 
 	addr.s_addr = packet.yiaddr;
 	LOG(LOG_INFO, "sending OFFER of %s", inet_ntoa(addr));
@@ -266,26 +255,24 @@ int sendOffer(struct dhcpMessage *oldpacket)
 int sendNAK(struct dhcpMessage *oldpacket)
 {
 	struct dhcpMessage packet;
+	struct option_builder opts;
 
-	init_packet(&packet, oldpacket, DHCPNAK);
+	init_packet(&packet, &opts, oldpacket, DHCPNAK);
 
 	DEBUG(LOG_INFO, "sending NAK");
 	return send_packet(&packet, 1);
 }
 
 
-int sendACK(struct dhcpMessage *oldpacket, uint32_t yiaddr)
+int sendACK(struct dhcp_request *request, uint32_t yiaddr)
 {
 	struct dhcpMessage packet;
-	struct option_set *curr;
+	struct option_builder opts;
 	uint8_t *lease_time;
 	uint32_t lease_time_align = server_config.lease;
 	struct in_addr addr;
 
-	init_packet(&packet, oldpacket, DHCPACK);
-	packet.yiaddr = yiaddr;
-
-	if ((lease_time = get_option(oldpacket, DHCP_LEASE_TIME))) {
+	if ((lease_time = request_option(request, DHCP_LEASE_TIME))) {
 		memcpy(&lease_time_align, lease_time, 4);
 		lease_time_align = ntohl(lease_time_align);
 		if (lease_time_align > server_config.lease)
@@ -294,19 +281,8 @@ int sendACK(struct dhcpMessage *oldpacket, uint32_t yiaddr)
 			lease_time_align = server_config.lease;
 	}
 
-
-	if (!add_mysql_options(&packet, oldpacket->chaddr)) {
-		add_simple_option(packet.options, DHCP_LEASE_TIME, htonl(lease_time_align));
-
-		curr = server_config.options;
-		while (curr) {
-			if (curr->data[OPT_CODE] != DHCP_LEASE_TIME)
-				add_option_string(packet.options, curr->data);
-			curr = curr->next;
-		}
-
-		add_bootp_options(&packet);
-	}
+	init_reply(&packet, &opts, request, DHCPACK, yiaddr);
+	reply_template_lease(&packet, lease_time_align);
 
 	addr.s_addr = packet.yiaddr;
 	LOG(LOG_INFO, "sending ACK to %s", inet_ntoa(addr));
@@ -314,23 +290,27 @@ int sendACK(struct dhcpMessage *oldpacket, uint32_t yiaddr)
 	if (send_packet(&packet, 0) < 0)
 		return -1;
 
+	pthread_mutex_lock(&server_lock);
 	add_lease(packet.chaddr, packet.yiaddr, lease_time_align);
+	pthread_mutex_unlock(&server_lock);
 
 	return 0;
 }
 
 
-int send_inform(struct dhcpMessage *oldpacket)
+int send_inform(struct dhcp_request *request)
 {
+	struct dhcpMessage *oldpacket = request->packet;
 	struct dhcpMessage packet;
+	struct option_builder opts;
 	struct option_set *curr;
 
-	init_packet(&packet, oldpacket, DHCPACK);
+	init_packet(&packet, &opts, oldpacket, DHCPACK);
 
 	curr = server_config.options;
 	while (curr) {
 		if (curr->data[OPT_CODE] != DHCP_LEASE_TIME)
-			add_option_string(packet.options, curr->data);
+			option_builder_add(&opts, curr->data);
 		curr = curr->next;
 	}
 
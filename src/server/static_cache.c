@@ -0,0 +1,278 @@
+/*
+ * static_cache.c -- in memory copy of the DHCPsql staticleases table
+ *
+ * find_address() asks reservedIp() about every address it walks past,
+ * which used to be a query per address. The table is kept here, hashed
+ * by MAC and by IP, and refreshed from MySQL on a timer or SIGUSR2.
+ * A refresh first compares a row count/checksum with what we hold and
+ * only reads the table when it changed. Rows are then updated in place
+ * and the ones that disappeared are swept, so lookups never see an
+ * empty cache in between.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/db_query.h"
+#include "udhcp/static_cache.h"
+#include "udhcp/addr_pool.h"
+
+struct static_entry {
+	uint8_t mac[6];
+	uint32_t ip;
+	int32_t class;
+	uint32_t generation;	/* refresh that last saw this row */
+	int mac_next;		/* hash chains, -1 terminated */
+	int ip_next;
+};
+
+struct static_cache_t static_cache;
+
+static struct static_entry *entries;
+static int entries_size, entries_used;
+static int free_entry = -1;		/* free entries, chained through mac_next */
+static int *mac_buckets, *ip_buckets;
+static unsigned int buckets_size;	/* power of two */
+static uint32_t generation;
+
+/* workers look static leases up without holding server_lock */
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+static unsigned int hash_mac(uint8_t *mac)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		h = (h ^ mac[i]) * 16777619u;
+	return h & (buckets_size - 1);
+}
+
+
+static unsigned int hash_ip(uint32_t ip)
+{
+	ip = (ip ^ (ip >> 16)) * 0x45d9f3b;
+	return (ip ^ (ip >> 16)) & (buckets_size - 1);
+}
+
+
+static void link_entry(int i)
+{
+	unsigned int h;
+
+	h = hash_mac(entries[i].mac);
+	entries[i].mac_next = mac_buckets[h];
+	mac_buckets[h] = i;
+
+	h = hash_ip(entries[i].ip);
+	entries[i].ip_next = ip_buckets[h];
+	ip_buckets[h] = i;
+}
+
+
+static void unlink_ip(int i)
+{
+	int *p = &ip_buckets[hash_ip(entries[i].ip)];
+
+	while (*p != i) p = &entries[*p].ip_next;
+	*p = entries[i].ip_next;
+}
+
+
+static void unlink_mac(int i)
+{
+	int *p = &mac_buckets[hash_mac(entries[i].mac)];
+
+	while (*p != i) p = &entries[*p].mac_next;
+	*p = entries[i].mac_next;
+}
+
+
+/* rehash everything into twice as many buckets */
+static void grow_buckets(void)
+{
+	unsigned int i;
+	int j;
+
+	free(mac_buckets);
+	free(ip_buckets);
+	buckets_size = buckets_size ? buckets_size * 2 : 256;
+	mac_buckets = xmalloc(buckets_size * sizeof(int));
+	ip_buckets = xmalloc(buckets_size * sizeof(int));
+	for (i = 0; i < buckets_size; i++)
+		mac_buckets[i] = ip_buckets[i] = -1;
+
+	for (j = 0; j < entries_size; j++)
+		if (entries[j].generation) link_entry(j);
+}
+
+
+static int find_mac(uint8_t *mac)
+{
+	int i;
+
+	if (!buckets_size) return -1;
+	for (i = mac_buckets[hash_mac(mac)]; i >= 0; i = entries[i].mac_next)
+		if (!memcmp(entries[i].mac, mac, 6)) return i;
+	return -1;
+}
+
+
+static int find_ip(uint32_t ip)
+{
+	int i;
+
+	if (!buckets_size) return -1;
+	for (i = ip_buckets[hash_ip(ip)]; i >= 0; i = entries[i].ip_next)
+		if (entries[i].ip == ip) return i;
+	return -1;
+}
+
+
+/* insert or update, returns 1 if the cache changed */
+static int cache_store(uint8_t *mac, uint32_t ip, int32_t class)
+{
+	int i;
+
+	if ((i = find_mac(mac)) >= 0) {
+		entries[i].generation = generation;
+		if (entries[i].ip == ip && entries[i].class == class)
+			return 0;
+		if (entries[i].ip != ip) {
+			unlink_ip(i);
+			addr_pool_mark(&addr_pool, ADDR_RESERVED, entries[i].ip, 0);
+			addr_pool_mark(&addr_pool, ADDR_RESERVED, ip, 1);
+			entries[i].ip = ip;
+			entries[i].ip_next = ip_buckets[hash_ip(ip)];
+			ip_buckets[hash_ip(ip)] = i;
+		}
+		entries[i].class = class;
+		return 1;
+	}
+
+	if (free_entry >= 0) {
+		i = free_entry;
+		free_entry = entries[i].mac_next;
+	} else {
+		if (entries_size == entries_used) {
+			entries_size = entries_size ? entries_size * 2 : 256;
+			entries = xrealloc(entries, entries_size * sizeof(struct static_entry));
+			memset(entries + entries_used, 0,
+			       (entries_size - entries_used) * sizeof(struct static_entry));
+		}
+		i = entries_used;
+	}
+	entries_used++;
+
+	memcpy(entries[i].mac, mac, 6);
+	entries[i].ip = ip;
+	entries[i].class = class;
+	entries[i].generation = generation;
+	addr_pool_mark(&addr_pool, ADDR_RESERVED, ip, 1);
+
+	if ((unsigned int) entries_used > buckets_size) grow_buckets();
+	else link_entry(i);
+	return 1;
+}
+
+
+/* drop the entries the last refresh didn't see, returns how many */
+static int cache_sweep(void)
+{
+	int i, removed = 0;
+
+	for (i = 0; i < entries_size; i++) {
+		if (!entries[i].generation || entries[i].generation == generation)
+			continue;
+		unlink_mac(i);
+		unlink_ip(i);
+		addr_pool_mark(&addr_pool, ADDR_RESERVED, entries[i].ip, 0);
+		entries[i].generation = 0;
+		entries[i].mac_next = free_entry;
+		free_entry = i;
+		entries_used--;
+		removed++;
+	}
+	return removed;
+}
+
+
+static void refresh_row(uint8_t *mac, uint32_t ip, int32_t class, void *arg)
+{
+	*(int *) arg += cache_store(mac, ip, class);
+}
+
+
+int static_cache_refresh(int force)
+{
+	uint32_t rows, sum;
+	int changed = 0, removed;
+
+	if (db_static_fingerprint(&rows, &sum) < 0) {
+		LOG(LOG_WARNING, "Could not check static leases, keeping the cached copy");
+		return -1;
+	}
+
+	if (!force && static_cache.loaded &&
+	    rows == static_cache.rows && sum == static_cache.sum)
+		return 0;
+
+	pthread_rwlock_wrlock(&cache_lock);
+	/* generation 0 marks free entries */
+	if (!++generation) generation = 1;
+	if (db_foreach_static_lease(refresh_row, &changed) < 0) {
+		pthread_rwlock_unlock(&cache_lock);
+		LOG(LOG_WARNING, "Could not read static leases, keeping the cached copy");
+		return -1;
+	}
+	removed = cache_sweep();
+
+	static_cache.rows = rows;
+	static_cache.sum = sum;
+	static_cache.loaded = 1;
+	pthread_rwlock_unlock(&cache_lock);
+	LOG(LOG_INFO, "Static lease cache: %d entries, %d added/changed, %d removed",
+		entries_used, changed, removed);
+	return changed + removed;
+}
+
+
+int static_cache_lookup(uint8_t *mac, uint32_t *ip, int32_t *class)
+{
+	int i, ret = 0;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	if (!static_cache.loaded) ret = -1;
+	else if ((i = find_mac(mac)) >= 0) {
+		*ip = entries[i].ip;
+		if (class) *class = entries[i].class;
+		ret = 1;
+	}
+	pthread_rwlock_unlock(&cache_lock);
+	return ret;
+}
+
+
+int static_cache_reserved(uint32_t ip)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&cache_lock);
+	ret = static_cache.loaded ? find_ip(ip) >= 0 : -1;
+	pthread_rwlock_unlock(&cache_lock);
+	return ret;
+}
+
+
+void static_cache_add(uint8_t *mac, uint32_t ip, int32_t class)
+{
+	pthread_rwlock_wrlock(&cache_lock);
+	if (!generation) generation = 1;
+	cache_store(mac, ip, class);
+	pthread_rwlock_unlock(&cache_lock);
+}
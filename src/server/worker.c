@@ -0,0 +1,176 @@
+/*
+ * worker.c -- answering requests from several threads
+ *
+ * With "workers N" each worker binds its own SO_REUSEPORT socket to
+ * the server port and reads, checks and answers its share of the
+ * requests, so one waiting on MySQL doesn't hold up the rest. Requests
+ * are split by a hash of chaddr: a reuseport program picks the socket
+ * for unicast ones, and as broadcasts are copied to every socket of
+ * the group, a socket filter drops the copies meant for other workers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#ifdef DHCPsql
+#include <mysql.h>
+#endif
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/common.h"
+#include "udhcp/socket.h"
+#include "udhcp/worker.h"
+#include "udhcp/journal.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/* chaddr[2..5] in a dhcpMessage, the part of a MAC that varies most */
+#define CHADDR_HASH_OFF	30
+
+struct workers_t workers;
+pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* both programs send a request to worker chaddr[2..5] % count */
+static int attach_filters(struct worker *w, int fd, int broadcast)
+{
+	/* run on the udp payload */
+	struct sock_filter pick[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, CHADDR_HASH_OFF),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers.count),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	/* run on the udp header, broadcasts that aren't ours are dropped */
+	struct sock_filter mine[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, INADDR_BROADCAST, 0, 4),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, sizeof(struct udphdr) + CHADDR_HASH_OFF),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers.count),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, w->id, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+	};
+	struct sock_fprog prog;
+
+	if (workers.count < 2) return 0;
+
+	/* without it the kernel hashes on addresses, which is still correct */
+	prog.len = sizeof(pick) / sizeof(pick[0]);
+	prog.filter = pick;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+		DEBUG(LOG_WARNING, "Could not attach reuseport program: %m");
+
+	prog.len = sizeof(mine) / sizeof(mine[0]);
+	prog.filter = mine;
+	if (broadcast && setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		LOG(LOG_ERR, "Could not attach socket filter, %m");
+		return -1;
+	}
+	return 0;
+}
+
+
+int worker_listen(struct worker *w)
+{
+	/* only several workers share the port, a second server must not */
+	if ((w->socket = workers.count > 1 ?
+	     listen_socket_shared(INADDR_ANY, SERVER_PORT, server_config.interface) :
+	     listen_socket(INADDR_ANY, SERVER_PORT, server_config.interface)) < 0) {
+		LOG(LOG_ERR, "couldn't create server socket, %m");
+		return -1;
+	}
+	if (attach_filters(w, w->socket, 1) < 0 ||
+	    event_add(w->loop, w->socket, w->readable, w) < 0) {
+		close(w->socket);
+		w->socket = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+
+	tx_queue = &w->tx;
+#ifdef DHCPsql
+	mysql_thread_init();
+#endif
+	event_loop_run(w->loop);
+#ifdef DHCPsql
+	mysql_thread_end();
+#endif
+	return NULL;
+}
+
+
+int workers_start(struct event_loop *main, event_handler readable)
+{
+	struct worker *w;
+	uint32_t i;
+
+	if (!workers.count) workers.count = 1;
+	workers.w = xcalloc(workers.count, sizeof(struct worker));
+
+	/* every socket is bound before any thread runs, so that worker i
+	 * is socket i of the reuseport group */
+	for (i = 0; i < workers.count; i++) {
+		w = &workers.w[i];
+		w->id = i;
+		w->readable = readable;
+		w->loop = main;
+		if (i && event_loop_init(w->loop = &w->own_loop) < 0)
+			return -1;
+
+		rx_ring_init(&w->rx);
+		if (tx_queue_init(&w->tx, server_config.server, SERVER_PORT, server_config.ifindex,
+				  workers.count > 1) < 0)
+			LOG(LOG_WARNING, "Could not open reply sockets, sending unbatched");
+		/* a lease is on disk before the reply granting it, even when
+		 * the queue fills up mid batch */
+		w->tx.before_send = journal_commit;
+		if (packet_mmap && tx_queue_mmap(&w->tx, server_config.arp) < 0)
+			LOG(LOG_WARNING, "Could not map a packet ring, sending with sendmmsg");
+
+		/* requests unicast to our address find the more specific bind */
+		if (w->tx.udp_fd >= 0 &&
+		    (attach_filters(w, w->tx.udp_fd, 0) < 0 ||
+		     event_add(w->loop, w->tx.udp_fd, readable, w) < 0))
+			return -1;
+
+		if (worker_listen(w) < 0)
+			return -1;
+	}
+
+	tx_queue = &workers.w[0].tx;
+	for (i = 1; i < workers.count; i++)
+		if (pthread_create(&workers.w[i].thread, NULL, worker_run, &workers.w[i])) {
+			LOG(LOG_ERR, "Could not start worker %u", i);
+			workers_stop();
+			return -1;
+		}
+
+	if (workers.count > 1)
+		LOG(LOG_INFO, "Answering requests from %u workers", workers.count);
+	return 0;
+}
+
+
+void workers_stop(void)
+{
+	uint32_t i;
+
+	for (i = 1; i < workers.count; i++) {
+		if (!workers.w[i].thread) continue;
+		event_loop_stop(&workers.w[i].own_loop);
+		pthread_join(workers.w[i].thread, NULL);
+		workers.w[i].thread = 0;
+	}
+}
@@ -15,6 +15,7 @@
 #include "udhcp/dhcpd.h"
 #include "udhcp/leases.h"
 #include "udhcp/libbb_udhcp.h"
+#include "udhcp/lease_db.h"
 
 #define REMAINING 0
 #define ABSOLUTE 1
@@ -24,10 +25,11 @@
 static void __attribute__ ((noreturn)) show_usage(void)
 {
 	printf(
-"Usage: dumpleases -f <file> -[r|a]\n\n"
+"Usage: dumpleases -f <file> -[r|a] [-m <mac>]\n\n"
 "  -f, --file=FILENAME             Leases file to load\n"
 "  -r, --remaining                 Interepret lease times as time remaing\n"
-"  -a, --absolute                  Interepret lease times as expire time\n");
+"  -a, --absolute                  Interepret lease times as expire time\n"
+"  -m, --mac=MAC                   Only show the lease of this client\n");
 	exit(0);
 }
 #else
@@ -35,6 +37,41 @@ static void __attribute__ ((noreturn)) show_usage(void)
 #endif
 
 
+static void print_lease(struct dhcpOfferedAddr *lease, int mode)
+{
+	int i;
+	long expires;
+	struct in_addr addr;
+
+	for (i = 0; i < 6; i++) {
+		printf("%02x", lease->chaddr[i]);
+		if (i != 5) printf(":");
+	}
+	addr.s_addr = lease->yiaddr;
+	printf(" %-15s", inet_ntoa(addr));
+	expires = ntohl(lease->expires);
+	printf(" ");
+	if (mode == REMAINING) {
+		if (!expires) printf("expired\n");
+		else {
+			if (expires > 60*60*24) {
+				printf("%ld days, ", expires / (60*60*24));
+				expires %= 60*60*24;
+			}
+			if (expires > 60*60) {
+				printf("%ld hours, ", expires / (60*60));
+				expires %= 60*60;
+			}
+			if (expires > 60) {
+				printf("%ld minutes, ", expires / 60);
+				expires %= 60;
+			}
+			printf("%ld seconds\n", expires);
+		}
+	} else printf("%s", ctime(&expires));
+}
+
+
 #ifdef IN_BUSYBOX
 int dumpleases_main(int argc, char *argv[])
 #else
@@ -42,22 +79,24 @@ int main(int argc, char *argv[])
 #endif
 {
 	FILE *fp;
-	int i, c, mode = REMAINING;
-	long expires;
+	int c, ret, mode = -1;
+	uint32_t n;
 	const char *file = LEASES_FILE;
-	struct dhcpOfferedAddr lease;
-	struct in_addr addr;
+	uint8_t mac[16], *chaddr = NULL;
+	struct dhcpOfferedAddr lease, *found = NULL;
+	struct lease_db db;
 
 	static const struct option options[] = {
 		{"absolute", 0, 0, 'a'},
 		{"remaining", 0, 0, 'r'},
 		{"file", 1, 0, 'f'},
+		{"mac", 1, 0, 'm'},
 		{0, 0, 0, 0}
 	};
 
 	while (1) {
 		int option_index = 0;
-		c = getopt_long(argc, argv, "arf:", options, &option_index);
+		c = getopt_long(argc, argv, "arf:m:", options, &option_index);
 		if (c == -1) break;
 
 		switch (c) {
@@ -66,45 +105,48 @@ int main(int argc, char *argv[])
 		case 'f':
 			file = optarg;
 			break;
+		case 'm':
+			memset(mac, 0, sizeof(mac));
+			if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+				   &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
+				show_usage();
+			chaddr = mac;
+			break;
 		default:
 			show_usage();
 		}
 	}
 
+	/* the file says how its times are kept, unless told otherwise */
+	if ((ret = lease_db_open(&db, file)) == 0) {
+		if (mode < 0) mode = db.flags & LEASE_DB_REMAINING ? REMAINING : ABSOLUTE;
+		printf("Mac Address       IP-Address      Expires %s\n", mode == REMAINING ? "in" : "at");
+		if (chaddr) {
+			if ((found = lease_db_find(&db, chaddr)))
+				print_lease(found, mode);
+		} else for (n = 0; n < db.count; n++)
+			print_lease(&db.records[n], mode);
+		lease_db_close(&db);
+		return chaddr && !found;
+	}
+
+	/* a lease file from before the header */
+	if (ret == -1) {
+		perror(file);
+		return 1;
+	}
+	if (mode < 0) mode = REMAINING;
 	fp = xfopen(file, "r");
 
 	printf("Mac Address       IP-Address      Expires %s\n", mode == REMAINING ? "in" : "at");
 	/*     "00:00:00:00:00:00 255.255.255.255 Wed Jun 30 21:49:08 1993" */
+	ret = 0;
 	while (fread(&lease, sizeof(lease), 1, fp)) {
-
-		for (i = 0; i < 6; i++) {
-			printf("%02x", lease.chaddr[i]);
-			if (i != 5) printf(":");
-		}
-		addr.s_addr = lease.yiaddr;
-		printf(" %-15s", inet_ntoa(addr));
-		expires = ntohl(lease.expires);
-		printf(" ");
-		if (mode == REMAINING) {
-			if (!expires) printf("expired\n");
-			else {
-				if (expires > 60*60*24) {
-					printf("%ld days, ", expires / (60*60*24));
-					expires %= 60*60*24;
-				}
-				if (expires > 60*60) {
-					printf("%ld hours, ", expires / (60*60));
-					expires %= 60*60;
-				}
-				if (expires > 60) {
-					printf("%ld minutes, ", expires / 60);
-					expires %= 60;
-				}
-				printf("%ld seconds\n", expires);
-			}
-		} else printf("%s", ctime(&expires));
+		if (chaddr && memcmp(lease.chaddr, chaddr, 16)) continue;
+		print_lease(&lease, mode);
+		ret = 1;
 	}
 	fclose(fp);
 
-	return 0;
+	return chaddr && !ret;
 }
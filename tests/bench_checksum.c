@@ -0,0 +1,85 @@
+/* Microbenchmark for checksum(), on the frames raw_packet() sends
+ *
+ * Sums a 548 byte DHCP message and the whole udp_dhcp_packet around
+ * it with the old 16 bit loop and with each implementation this CPU
+ * runs. Not run by ctest, start bench_checksum by hand. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "udhcp/packet.h"
+#include "udhcp/checksum.h"
+
+#define ROUNDS 2000000
+
+/* the loop checksum() used to be */
+static uint16_t old_checksum(void *addr, int count) {
+    register int32_t sum = 0;
+    uint16_t *source = (uint16_t *) addr;
+
+    while (count > 1) {
+        sum += *source++;
+        count -= 2;
+    }
+    if (count > 0) {
+        uint16_t tmp = 0;
+        *(uint8_t *) (&tmp) = *(uint8_t *) source;
+        sum += tmp;
+    }
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ns per call, the first run sets the baseline for the speedup */
+static void bench(const char *name, uint16_t (*fn)(void *, int), void *data, int len) {
+    static double base;
+    volatile uint16_t sink;
+    double start, ns;
+    int i;
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        /* a different frame every round, as the xid would make it */
+        ((uint8_t *) data)[4] = i;
+        sink = fn(data, len);
+    }
+    (void) sink;
+    ns = (now() - start) * 1e9 / ROUNDS;
+    if (fn == old_checksum) base = ns;
+    printf("  %-10s %7.1f ns  %5.2fx\n", name, ns, base / ns);
+}
+
+static void bench_all(void *data, int len) {
+    printf("%d bytes:\n", len);
+    bench("old", old_checksum, data, len);
+    bench("scalar", checksum_scalar, data, len);
+#ifdef CHECKSUM_X86
+    if (checksum_have_sse2())
+        bench("sse2", checksum_sse2, data, len);
+    if (checksum_have_avx2())
+        bench("avx2", checksum_avx2, data, len);
+#endif
+    bench("checksum", checksum, data, len);
+}
+
+int main() {
+    struct udp_dhcp_packet packet;
+    uint8_t *p = (uint8_t *) &packet;
+    int i;
+
+    for (i = 0; i < (int) sizeof(packet); i++)
+        p[i] = rand();
+
+    bench_all(&packet.data, sizeof(struct dhcpMessage));
+    bench_all(&packet, sizeof(packet));
+    return 0;
+}
@@ -0,0 +1,151 @@
+/* Startup benchmark for loading the lease file
+ *
+ * Writes synthetic lease files of 10k, 100k and 1M leases, some of
+ * them renewed to a new address or reserved, and times mapping one
+ * and loading it with lease_load() against the add_lease() per record
+ * read_leases() used to do. Both must leave the same leases behind.
+ * Not run by ctest, start bench_lease_load by hand. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/leases.h"
+#include "udhcp/lease_shard.h"
+#include "udhcp/addr_pool.h"
+#include "udhcp/lease_db.h"
+#include "udhcp/worker.h"
+
+#define FILE_NAME "bench_lease_load.leases"
+
+/* what leases.c and lease_shard.c need from the rest of the server */
+struct server_config_t server_config;
+struct dhcpOfferedAddr *leases;
+struct workers_t workers;
+pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int arp_probe_room(void) { return 1; }
+void arp_probe_conflict(uint32_t yiaddr) { (void) yiaddr; }
+int arpping(uint32_t yiaddr, uint32_t ip, uint8_t *mac, char *interface) {
+    (void) yiaddr; (void) ip; (void) mac; (void) interface;
+    return 1;
+}
+int reservedIp(struct static_lease *lease_struct, uint32_t ip) {
+    (void) lease_struct; (void) ip;
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* an empty table, as at startup */
+static void fresh(uint32_t max) {
+    leases = calloc(max, sizeof(struct dhcpOfferedAddr));
+    addr_pool_init(&addr_pool, server_config.start, server_config.end);
+    lease_shards.count = 4;
+    lease_shards_init(leases, max);
+}
+
+/* n records in the order the server would have written them: every
+ * 16th renews an earlier client to a new address, every 64th is a
+ * declined address */
+static struct dhcpOfferedAddr *synthetic(uint32_t n) {
+    struct dhcpOfferedAddr *r = calloc(n, sizeof(struct dhcpOfferedAddr));
+    uint32_t start = ntohl(server_config.start), i, expires = time(0) + 3600;
+
+    for (i = 0; i < n; i++) {
+        r[i].yiaddr = htonl(start + i);
+        r[i].expires = htonl(expires + i % 7200);
+        if (i % 64 == 63) continue;
+        if (i % 16 == 15)
+            memcpy(r[i].chaddr, r[rand() % i].chaddr, 16);
+        else {
+            r[i].chaddr[0] = 0x02;
+            r[i].chaddr[2] = i >> 24;
+            r[i].chaddr[3] = i >> 16;
+            r[i].chaddr[4] = i >> 8;
+            r[i].chaddr[5] = i;
+        }
+    }
+    return r;
+}
+
+/* the loop read_leases() had */
+static uint32_t add_each(struct dhcpOfferedAddr *r, uint32_t n) {
+    time_t curr = time(0);
+    uint32_t i, loaded = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!memcmp(r[i].chaddr, blank_chaddr, 16))
+            lease_reserve(r[i].yiaddr, ntohl(r[i].expires) - curr);
+        else if (!add_lease(r[i].chaddr, r[i].yiaddr, ntohl(r[i].expires) - curr))
+            continue;
+        loaded++;
+    }
+    return loaded;
+}
+
+static void bench(uint32_t n) {
+    struct dhcpOfferedAddr *r, *lease;
+    uint32_t *held = malloc(n * sizeof(uint32_t)), max = n + n / 4, i, full, loaded;
+    struct lease_db db;
+    double start, t_each, t_load;
+    FILE *fp;
+    int same = 1;
+
+    server_config.start = inet_addr("10.0.0.1");
+    server_config.end = htonl(ntohl(server_config.start) + max - 1);
+    server_config.max_leases = max;
+    r = synthetic(n);
+
+    fp = fopen(FILE_NAME, "w");
+    if (!fp || lease_db_write(fp, r, n, 0) < 0 || fclose(fp)) {
+        perror(FILE_NAME);
+        exit(1);
+    }
+
+    fresh(max);
+    start = now();
+    lease_shards_lock();
+    add_each(r, n);
+    lease_shards_unlock();
+    t_each = now() - start;
+    for (i = 0; i < n; i++)
+        held[i] = (lease = find_lease_by_chaddr(r[i].chaddr)) ? lease->yiaddr : 0;
+
+    fresh(max);
+    start = now();
+    lease_shards_lock();
+    if (lease_db_open(&db, FILE_NAME) < 0) {
+        fprintf(stderr, "can't map %s\n", FILE_NAME);
+        exit(1);
+    }
+    loaded = lease_load(db.records, db.count, db.flags & LEASE_DB_REMAINING, &full);
+    lease_db_close(&db);
+    lease_shards_unlock();
+    t_load = now() - start;
+    for (i = 0; i < n; i++)
+        if (held[i] != ((lease = find_lease_by_chaddr(r[i].chaddr)) ? lease->yiaddr : 0))
+            same = 0;
+
+    printf("%8u leases: add_lease %8.1f ms  lease_load %7.1f ms  %5.2fx  %u loaded%s\n",
+           n, t_each * 1e3, t_load * 1e3, t_each / t_load, loaded, same ? "" : "  DIFFERENT");
+    unlink(FILE_NAME);
+    free(held);
+    free(r);
+}
+
+int main() {
+    bench(10000);
+    bench(100000);
+    bench(1000000);
+    return 0;
+}
@@ -0,0 +1,144 @@
+/* Unit tests for DHCP option parsing */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "udhcp/dhcpd.h"
+#include "udhcp/options.h"
+#include "udhcp/option_index.h"
+#include "udhcp/option_builder.h"
+
+static void build_overloaded(struct dhcpMessage *packet) {
+    memset(packet, 0, sizeof(struct dhcpMessage));
+    packet->options[0] = DHCP_MESSAGE_TYPE;
+    packet->options[1] = 1;
+    packet->options[2] = DHCPREQUEST;
+    packet->options[3] = DHCP_OPTION_OVER;
+    packet->options[4] = 1;
+    packet->options[5] = FILE_FIELD | SNAME_FIELD;
+    packet->options[6] = DHCP_PADDING;
+    packet->options[7] = DHCP_END;
+
+    packet->file[0] = DHCP_SERVER_ID;
+    packet->file[1] = 4;
+    memcpy(packet->file + 2, "\x0a\x00\x00\x01", 4);
+    packet->file[6] = DHCP_END;
+
+    packet->sname[0] = DHCP_LEASE_TIME;
+    packet->sname[1] = 4;
+    packet->sname[6] = DHCP_END;
+}
+
+void test_index_lookup() {
+    struct dhcpMessage packet;
+    struct option_index idx;
+    uint8_t *data;
+
+    printf("Testing option index lookups...\n");
+    build_overloaded(&packet);
+    assert(option_index_build(&idx, &packet) == 0);
+
+    data = option_index_get(&idx, &packet, DHCP_MESSAGE_TYPE);
+    assert(data != NULL && *data == DHCPREQUEST);
+    assert(option_index_get(&idx, &packet, DHCP_SERVER_ID) == packet.file + 2);
+    assert(idx.len[DHCP_SERVER_ID] == 4);
+    assert(option_index_get(&idx, &packet, DHCP_LEASE_TIME) == packet.sname + 2);
+    assert(option_index_get(&idx, &packet, DHCP_REQUESTED_IP) == NULL);
+
+    /* get_option() goes through the same parser */
+    assert(get_option(&packet, DHCP_SERVER_ID) == packet.file + 2);
+    printf("✓ Option index lookup test passed\n");
+}
+
+void test_index_copy() {
+    struct dhcpMessage packet, copy;
+    struct option_index idx;
+
+    printf("Testing option index on a copied packet...\n");
+    build_overloaded(&packet);
+    option_index_build(&idx, &packet);
+    memcpy(&copy, &packet, sizeof(packet));
+    assert(option_index_get(&idx, &copy, DHCP_SERVER_ID) == copy.file + 2);
+    printf("✓ Option index copy test passed\n");
+}
+
+void test_bounds() {
+    struct dhcpMessage packet;
+    struct option_index idx;
+
+    printf("Testing option bounds checks...\n");
+
+    /* runs past the end of sname, what came before is kept */
+    build_overloaded(&packet);
+    packet.sname[6] = DHCP_REQUESTED_IP;
+    packet.sname[7] = 60;
+    assert(option_index_build(&idx, &packet) < 0);
+    assert(option_index_get(&idx, &packet, DHCP_LEASE_TIME) != NULL);
+    assert(option_index_get(&idx, &packet, DHCP_REQUESTED_IP) == NULL);
+
+    /* no END option */
+    memset(&packet, 0, sizeof(packet));
+    packet.options[0] = DHCP_MESSAGE_TYPE;
+    packet.options[1] = 1;
+    packet.options[2] = DHCPDISCOVER;
+    assert(option_index_build(&idx, &packet) < 0);
+    assert(option_index_get(&idx, &packet, DHCP_MESSAGE_TYPE) != NULL);
+
+    /* length byte past the options field */
+    memset(&packet, 0, sizeof(packet));
+    packet.options[307] = DHCP_MESSAGE_TYPE;
+    assert(option_index_build(&idx, &packet) < 0);
+    assert(option_index_get(&idx, &packet, DHCP_MESSAGE_TYPE) == NULL);
+    printf("✓ Option bounds test passed\n");
+}
+
+void test_builder() {
+    struct dhcpMessage packet;
+    struct option_builder opts;
+    struct option_index idx;
+    uint8_t hostname[] = { DHCP_HOST_NAME, 4, 't', 'e', 's', 't' };
+    uint8_t big[2 + 255];
+    uint32_t lease;
+
+    printf("Testing option builder...\n");
+    memset(&packet, 0, sizeof(packet));
+    packet.options[0] = DHCP_END;
+    option_builder_init(&opts, packet.options);
+    assert(opts.end == 0);
+
+    assert(option_builder_simple(&opts, DHCP_MESSAGE_TYPE, DHCPOFFER) == 3);
+    assert(option_builder_simple(&opts, DHCP_LEASE_TIME, htonl(3600)) == 6);
+    assert(option_builder_add(&opts, hostname) == sizeof(hostname));
+    assert(option_builder_simple(&opts, 0xfe, 1) == 0);
+    assert(opts.end == 3 + 6 + sizeof(hostname));
+    assert(packet.options[opts.end] == DHCP_END);
+    assert(end_option(packet.options) == opts.end);
+
+    option_index_build(&idx, &packet);
+    memcpy(&lease, option_index_get(&idx, &packet, DHCP_LEASE_TIME), 4);
+    assert(ntohl(lease) == 3600);
+
+    /* a full field refuses what doesn't fit and stays terminated */
+    memset(big, 'x', sizeof(big));
+    big[OPT_CODE] = DHCP_MESSAGE;
+    big[OPT_LEN] = 255;
+    assert(option_builder_add(&opts, big) == 257);
+    assert(option_builder_add(&opts, big) == 0);
+    assert(packet.options[opts.end] == DHCP_END);
+    assert(end_option(packet.options) == opts.end);
+    printf("✓ Option builder test passed\n");
+}
+
+int main() {
+    printf("Running option tests...\n\n");
+
+    test_index_lookup();
+    test_index_copy();
+    test_bounds();
+    test_builder();
+
+    printf("\n✓ All option tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* Unit tests for packet checksums */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "udhcp/packet.h"
+#include "udhcp/checksum.h"
+
+/* the 16 bit loop checksum() used to be */
+static uint16_t reference(uint8_t *data, int count) {
+    uint32_t sum = 0;
+    uint16_t word;
+
+    for (; count > 1; data += 2, count -= 2) {
+        memcpy(&word, data, 2);
+        sum += word;
+    }
+    if (count > 0) {
+        word = 0;
+        *(uint8_t *) &word = *data;
+        sum += word;
+    }
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+void test_checksum_known() {
+    /* the example in RFC 1071 */
+    uint8_t data[] = { 0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7 };
+
+    printf("Testing checksum of known data...\n");
+    assert(ntohs(checksum(data, sizeof(data))) == 0x220d);
+    assert(checksum(data, 0) == 0xffff);
+    printf("✓ Known checksum test passed\n");
+}
+
+void test_checksum_implementations() {
+    uint8_t buf[2048 + 4];
+    int len, off, i;
+
+    printf("Testing checksum implementations against each other...\n");
+    srand(1);
+    for (i = 0; i < (int) sizeof(buf); i++)
+        buf[i] = rand();
+
+    /* every length up to a couple of frames, at odd alignments */
+    for (off = 0; off < 4; off++) {
+        for (len = 0; len <= 2048; len++) {
+            uint16_t want = reference(buf + off, len);
+
+            assert(checksum(buf + off, len) == want);
+            assert(checksum_scalar(buf + off, len) == want);
+#ifdef CHECKSUM_X86
+            if (checksum_have_sse2())
+                assert(checksum_sse2(buf + off, len) == want);
+            if (checksum_have_avx2())
+                assert(checksum_avx2(buf + off, len) == want);
+#endif
+        }
+    }
+
+    /* all ones is where a carry would be lost */
+    memset(buf, 0xff, sizeof(buf));
+    assert(checksum(buf, 2048) == reference(buf, 2048));
+    printf("✓ Checksum implementations test passed\n");
+}
+
+void test_checksum_verify() {
+    struct udp_dhcp_packet packet;
+    uint8_t *p = (uint8_t *) &packet;
+    int i;
+
+    printf("Testing checksum verification...\n");
+    for (i = 0; i < (int) sizeof(packet); i++)
+        p[i] = i * 7;
+    packet.udp.check = 0;
+    packet.udp.check = checksum(&packet, sizeof(packet));
+
+    /* a datagram with its checksum in place sums to zero */
+    assert(checksum(&packet, sizeof(packet)) == 0);
+    p[100] ^= 1;
+    assert(checksum(&packet, sizeof(packet)) != 0);
+    printf("✓ Checksum verification test passed\n");
+}
+
+int main() {
+    printf("Running packet tests...\n\n");
+
+    test_checksum_known();
+    test_checksum_implementations();
+    test_checksum_verify();
+
+    printf("\n✓ All packet tests passed!\n");
+    return 0;
+}